@@ -1,403 +1,4945 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 #include "TnOF_BIB.h"
+#include "TnOF_SYS.h"
 
-void open(TnOF *file, const char *filename, const char mode) 
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+//--- File name built into dst of size bytes; "" (no such file) when it does not fit, never a truncated name ---//
+static void formatName(char *dst, size_t size, const char *format, ...)
 {
-    if (mode == 'o')
-    {
-        file->f = fopen(filename, "rb+");
-        fread(&(file->header), sizeof(Header), 1, file->f);
-    }
-    else 
-    {
-        file->f = fopen(filename, "wb+");
-        file->header.nb_block = 0;
-        file->header.nb_rec = 0;
-        fwrite(&(file->header), sizeof(Header), 1, file->f);
-    }
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(dst, size, format, args);
+    va_end(args);
+    if (length < 0 || (size_t)length >= size) dst[0] = '\0';
 }
 
-void close(TnOF file) 
+static int currentBackend = BACKEND_STDIO;
+
+void setBackend(int backend)
 {
-    rewind(file.f);
-    fwrite(&(file.header), sizeof(Header), 1, file.f);
-    fclose(file.f);
-    file.f = NULL;
+    currentBackend = backend;
 }
 
-int readBlock(TnOF file, int i, Tblock *buf)
+int getBackend()
 {
-    if ((i > file.header.nb_block) || (i < 1)) return 0; 
-    fseek(file.f, sizeof(Header) + (i - 1) * sizeof(Tblock), 0);
-    fread(buf, sizeof(Tblock), 1, file.f);
-    return 1;
+    return currentBackend;
 }
 
-int writeBlock(TnOF file, int i, Tblock buf) 
+static int directIO = 0;
+
+void setDirectIO(int on)
 {
-    if ((i > file.header.nb_block) || (i < 1)) return 0; 
-    fseek(file.f, sizeof(Header) + (i - 1) * sizeof(Tblock), 0);
-    fwrite(&buf, sizeof(Tblock), 1, file.f);
-    return 0;
+    directIO = on;
 }
 
-int getHeader(TnOF file, int i) {
-    switch(i)
-    {
-        case 1:
-            return file.header.nb_block; 
-        case 2:   
-            return file.header.nb_rec; 
-        case 3:
-            return file.header.blockCapacity; 
-        default:
-            return 0;
-    }
+int getDirectIO()
+{
+    return directIO;
 }
 
-void allocateBlock(TnOF *file) 
+//--- I/O statistics ---//
+
+#define STATS_BUCKETS 256
+
+typedef struct FileStats
 {
-    Tblock newBlock;
-    newBlock.nb_rec = 0;
-    fseek(file->f, 0, SEEK_END);
-    fwrite(&newBlock, sizeof(Tblock), 1, file->f);
-    file->header.nb_block++;
+    IOStats stats;
+    int handles;            // opened and not closed yet (guarded by handlesLock, like the next two)
+    int compacting;         // taken by the background compactor: open() waits
+    int tombstoned;         // got tombstones since the compactor last looked at it
+    FILE *poolHandle;       // write-back handle kept by the buffer pool, NULL if none (guarded by poolLock, like the next four)
+    long poolHandleUse;     // last use: the least recently used handle is closed first
+    int poolNextBlock;      // block that continues the current run of in-order reads
+    int poolRun;            // length of that run, a sequential scan from POOL_SCAN_RUN on
+    int poolScanFrame;      // frame of the last block read by the scan
+    struct FileStats *next;         // every entry
+    struct FileStats *bucketNext;   // entries of the same name hash
+    char name[];
+}FileStats;
+
+// global counters, aggregated per thread: a thread adds to its own entry, getGlobalStats() sums them
+typedef struct ThreadStats
+{
+    IOStats stats;          // written by its thread only
+    int live;               // 0 once the thread exited: its counts moved to retiredStats, the entry is reused
+    struct ThreadStats *next;
+}ThreadStats;
+
+static FileStats *fileStats = NULL;     // entries are never moved, TnOF handles keep pointers to them
+static FileStats *statsBuckets[STATS_BUCKETS];
+static ThreadStats *threadStats = NULL;
+static IOStats retiredStats;            // counts of the exited threads
+static IOStats resetStats;              // totals at the last resetIOStats()
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t threadStatsKey;
+static pthread_once_t threadStatsOnce = PTHREAD_ONCE_INIT;
+static __thread ThreadStats *localStats = NULL;
+static int ioTiming = 1;
+
+static void retireThreadStats(void *entry)
+{
+    ThreadStats *local = entry;
+    long *from = (long *)&local->stats, *to = (long *)&retiredStats;
+    pthread_mutex_lock(&statsLock);
+    for (size_t c = 0; c < sizeof(IOStats) / sizeof(long); c++) to[c] += from[c]; // every counter is a long
+    memset(&local->stats, 0, sizeof(IOStats));
+    local->live = 0;
+    pthread_mutex_unlock(&statsLock);
 }
 
-void initialLoad(TnOF *file) //--- Create a new file and initialize it ---//
+static void createThreadStatsKey()
 {
-    char name[20];
-    printf("Enter the name of the file to create: ");
-    scanf("%s", name);
-    getchar();
-    open(file, name, 'n');
+    pthread_key_create(&threadStatsKey, retireThreadStats);
+}
 
-    // Display max records info and get loading factor
-    printf("Maximum records per block: %d\n", MAX_RECORDS);
-    printf("Enter loading factor (0.0 to 1.0): ");
-    float loadingFactor;
-    scanf("%f", &loadingFactor);
-    getchar();
-    
-    if (loadingFactor <= 0.0 || loadingFactor > 1.0) {
-        printf("Invalid loading factor! Using default 0.8\n");
-        loadingFactor = 0.8;
+//--- Counters of the calling thread, an entry taken on its first I/O ---//
+static IOStats *threadStatsOf()
+{
+    if (localStats != NULL) return &localStats->stats;
+    pthread_once(&threadStatsOnce, createThreadStatsKey);
+    pthread_mutex_lock(&statsLock);
+    ThreadStats *entry = threadStats;
+    while (entry != NULL && entry->live) entry = entry->next;
+    if (entry == NULL) {
+        entry = calloc(1, sizeof(ThreadStats));
+        entry->next = threadStats;
+        threadStats = entry;
     }
+    entry->live = 1;
+    pthread_mutex_unlock(&statsLock);
+    pthread_setspecific(threadStatsKey, entry);
+    localStats = entry;
+    return &entry->stats;
+}
 
-    // Calculate effective block capacity based on loading factor
-    int blockCapacity = (int)(MAX_RECORDS * loadingFactor);
-    if (blockCapacity < 1) blockCapacity = 1; // At least 1 record per block
-    file->header.blockCapacity = blockCapacity; // Store in header
-    printf("Effective records per block: %d\n", blockCapacity);
+// adds n to a counter of the file and to the thread's share of the global one
+#define STAT_ADD(stats, field, n) do { \
+        long statN = (long)(n); \
+        IOStats *statLocal = threadStatsOf(); \
+        __atomic_store_n(&statLocal->field, statLocal->field + statN, __ATOMIC_RELAXED); \
+        if ((stats) != NULL) __atomic_fetch_add(&(stats)->field, statN, __ATOMIC_RELAXED); \
+    } while (0)
 
-    int numBlocks, i = 0, j = 0;
-    printf("Enter the number of blocks to create: ");
-    do
-    {
-        scanf("%d", &numBlocks);
-        getchar();
-    } while(numBlocks < 1);
+// adds the time since start to a timing counter, when the timing is on
+#define STAT_TIME(stats, field, start) do { \
+        if (ioTiming) STAT_ADD(stats, field, nanosNow() - (start)); \
+    } while (0)
 
-    int numRecords = numBlocks * blockCapacity; // Total records = blocks × capacity
+static long nanosNow()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
 
-    Tblock buf;
-    buf.nb_rec = 0;
-    printf("\nProceed with data entry (%d records total):\n", numRecords);
-    while(i < numRecords)
-    {
-        if((j + 1) <= blockCapacity) //--- Use loading factor capacity instead of MAX_RECORDS ---//
-        {
-            printf("\nKey %d = ", i + 1);
-            scanf("%d", &(buf.T[j].key));
-            getchar();
-            i++;
-            j++;
-        }
-        else
-        {
-            allocateBlock(file);
-            buf.nb_rec = j;
-            writeBlock(*file, file->header.nb_block, buf);
-            j = 0;
-        }
-    }
-    if(j != 0)
-    {
-        allocateBlock(file);
-        buf.nb_rec = j;
-        writeBlock(*file, file->header.nb_block, buf);
+//--- Start of a timed call, 0 without reading the clock when the timing is off ---//
+static long timerStart()
+{
+    return ioTiming ? nanosNow() : 0;
+}
+
+void setIOTiming(int on)
+{
+    ioTiming = on;
+}
+
+int getIOTiming()
+{
+    return ioTiming;
+}
+
+static unsigned statsBucket(const char *filename)
+{
+    unsigned h = 2166136261u; // FNV-1a
+    for (const char *c = filename; *c != '\0'; c++) h = (h ^ (unsigned char)*c) * 16777619u;
+    return h & (STATS_BUCKETS - 1);
+}
+
+//--- Entry of a file name, NULL if it was never opened (statsLock held) ---//
+static FileStats *findStats(const char *filename)
+{
+    FileStats *entry = statsBuckets[statsBucket(filename)];
+    while (entry != NULL && strcmp(entry->name, filename) != 0) entry = entry->bucketNext;
+    return entry;
+}
+
+static IOStats *statsOf(const char *filename)
+{
+    pthread_mutex_lock(&statsLock);
+    FileStats *entry = findStats(filename);
+    if (entry == NULL) {
+        size_t length = strlen(filename);
+        entry = calloc(1, sizeof(FileStats) + length + 1);
+        memcpy(entry->name, filename, length + 1);
+        unsigned bucket = statsBucket(filename);
+        entry->bucketNext = statsBuckets[bucket];
+        statsBuckets[bucket] = entry;
+        entry->next = fileStats;
+        fileStats = entry;
     }
-    file->header.nb_rec = numRecords;
-    close(*file);
+    pthread_mutex_unlock(&statsLock);
+    return &entry->stats;
 }
 
+//--- Handles of each file: the background compactor only takes a file nobody has open ---//
+static pthread_mutex_t handlesLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t handlesChanged = PTHREAD_COND_INITIALIZER;
+static pthread_t compactorThread;
+static int compactorRunning = 0;
 
-void searchTnOF(const int key, const char *filename,int *found, int *i, int *j)
+static FileStats *entryOf(IOStats *stats)
 {
-    int stop = 0;
-    TnOF file;
-    Tblock buffer;
-    open(&file, filename, 'o');
-    int nbBlocks = getHeader(file, 1);
-    *i=0, *j=0,*found=0;
-    while((*i<nbBlocks) && (!*found) && (!stop))
-    {
-        *i=*i+1;
+    return (FileStats *)((char *)stats - offsetof(FileStats, stats));
+}
 
-        readBlock(file, *i, &buffer);
-        *j=0;
-        while(*j<buffer.nb_rec){
-            if(key == buffer.T[*j].key){
-                *found = 1;
-                stop=1;
-                break;
-            }
+static void acquireFile(IOStats *stats)
+{
+    FileStats *entry = entryOf(stats);
+    pthread_mutex_lock(&handlesLock);
+    while (entry->compacting && !(compactorRunning && pthread_equal(pthread_self(), compactorThread))) {
+        pthread_cond_wait(&handlesChanged, &handlesLock);
+    }
+    entry->handles++;
+    pthread_mutex_unlock(&handlesLock);
+}
 
-            *j=*j+1;
-        }
+static void releaseFile(IOStats *stats)
+{
+    pthread_mutex_lock(&handlesLock);
+    entryOf(stats)->handles--;
+    pthread_mutex_unlock(&handlesLock);
+}
+
+//--- Sum of the thread counters since the last reset (statsLock held) ---//
+static void sumThreadStats(IOStats *total)
+{
+    long *sum = (long *)total;
+    const long *retired = (const long *)&retiredStats, *reset = (const long *)&resetStats;
+    for (size_t c = 0; c < sizeof(IOStats) / sizeof(long); c++) sum[c] = retired[c] - reset[c];
+    for (ThreadStats *entry = threadStats; entry != NULL; entry = entry->next) {
+        long *counters = (long *)&entry->stats;
+        for (size_t c = 0; c < sizeof(IOStats) / sizeof(long); c++) sum[c] += __atomic_load_n(&counters[c], __ATOMIC_RELAXED);
     }
-    //in case the the record should be in a new bloc
-    int blockCapacity = getHeader(file, 3);
-    if(*j >= blockCapacity){
-        *i=*i+1;
-        *j=0;
-    } 
+}
 
-    close (file);
+const IOStats *getGlobalStats()
+{
+    static __thread IOStats globalStats; // a snapshot, taken again on every call
+    pthread_mutex_lock(&statsLock);
+    sumThreadStats(&globalStats);
+    pthread_mutex_unlock(&statsLock);
+    return &globalStats;
+}
+
+const IOStats *getFileStats(const char *filename)
+{
+    pthread_mutex_lock(&statsLock);
+    FileStats *entry = findStats(filename);
+    pthread_mutex_unlock(&statsLock);
+    return (entry != NULL) ? &entry->stats : NULL;
 }
 
+void resetIOStats()
+{
+    pthread_mutex_lock(&statsLock);
+    IOStats total;
+    sumThreadStats(&total);
+    long *reset = (long *)&resetStats;
+    const long *counters = (const long *)&total;
+    for (size_t c = 0; c < sizeof(IOStats) / sizeof(long); c++) reset[c] += counters[c]; // the thread counters keep running
+    for (FileStats *entry = fileStats; entry != NULL; entry = entry->next) memset(&entry->stats, 0, sizeof(IOStats));
+    pthread_mutex_unlock(&statsLock);
+}
 
-void inserTnOF(const char *filename, Record record) //--- Procedure to insert a record ---//
+static void diffIOStats(const IOStats *after, const IOStats *before, IOStats *delta)
 {
-    int found, i, j;
-    TnOF file;
-    Tblock buffer;
+    delta->blockReads = after->blockReads - before->blockReads;
+    delta->blockWrites = after->blockWrites - before->blockWrites;
+    delta->headerReads = after->headerReads - before->headerReads;
+    delta->headerWrites = after->headerWrites - before->headerWrites;
+    delta->seeks = after->seeks - before->seeks;
+    delta->opens = after->opens - before->opens;
+    delta->closes = after->closes - before->closes;
+    delta->bytesRead = after->bytesRead - before->bytesRead;
+    delta->bytesWritten = after->bytesWritten - before->bytesWritten;
+    delta->readNanos = after->readNanos - before->readNanos;
+    delta->writeNanos = after->writeNanos - before->writeNanos;
+    delta->openNanos = after->openNanos - before->openNanos;
+    delta->closeNanos = after->closeNanos - before->closeNanos;
+}
 
-    // Find insertion position (don't check for duplicates)
-    open(&file, filename, 'o');
-    int nbBlocks = getHeader(file, 1);
-    int blockCapacity = getHeader(file, 3);
-    
-    if (nbBlocks == 0) {
-        // Empty file - insert at block 1, position 0
-        i = 1;
-        j = 0;
-    } else {
-        // Read last block to find insertion position
-        readBlock(file, nbBlocks, &buffer);
-        if (buffer.nb_rec < blockCapacity) {
-            // Space in last block
-            i = nbBlocks;
-            j = buffer.nb_rec;
-        } else {
-            // Need new block
-            i = nbBlocks + 1;
-            j = 0;
+void printIOStats(const char *label, const IOStats *stats)
+{
+    printf("%s:\n", label);
+    printf("\t- Blocks: %ld read, %ld written\n", stats->blockReads, stats->blockWrites);
+    printf("\t- Headers: %ld read, %ld written\n", stats->headerReads, stats->headerWrites);
+    printf("\t- Calls: %ld seeks, %ld fopen, %ld fclose\n", stats->seeks, stats->opens, stats->closes);
+    printf("\t- Bytes: %ld read, %ld written\n", stats->bytesRead, stats->bytesWritten);
+    printf("\t- Time (ms): read %.3f, write %.3f, open %.3f, close %.3f\n", stats->readNanos / 1e6,
+           stats->writeNanos / 1e6, stats->openNanos / 1e6, stats->closeNanos / 1e6);
+}
+
+//--- Buffer pool ---//
+// Frames are found through a chained hash table on (file, block). The file is identified by its
+// IOStats entry, which is unique per file name. While the pool is enabled all block I/O of stdio files
+// uses pread / pwrite, so no stale copy of a block can sit in a stdio buffer.
+// Dirty frames are written back through a handle kept in the file's entry. A sequential scan neither
+// promotes the frames it hits nor spreads over the pool: it recycles the frame of its previous block.
+
+#define POOL_HANDLES  32    // write-back handles kept open
+#define POOL_SCAN_RUN 4     // blocks read in order before a file counts as scanned
+
+typedef struct PoolFrame
+{
+    IOStats *file;          // NULL for a free frame
+    int block;
+    int dirty;
+    int referenced;         // CLOCK bit
+    int next;               // next frame in the same hash bucket, -1 at the end
+    Tblock data;
+}PoolFrame;
+
+static PoolFrame *poolFrames = NULL;
+static int *poolBuckets = NULL;
+static int poolSize = 0, poolBucketMask = 0, poolHand = 0;
+static PoolStats poolStats;
+static FileStats *poolHandles[POOL_HANDLES];    // entries holding a write-back handle
+static int poolHandleCount = 0;
+static long poolTick = 0;
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+
+#define HEADER_SIZE BLOCK_SIZE // the header is alone in the first block, so block i starts at i * BLOCK_SIZE
+
+static long blockOffset(int i)
+{
+    return HEADER_SIZE + (long)(i - 1) * sizeof(Tblock);
+}
+
+static const char *fileNameOf(IOStats *file)
+{
+    return ((FileStats *)((char *)file - offsetof(FileStats, stats)))->name;
+}
+
+static int poolBucket(IOStats *file, int block)
+{
+    return (int)((((uintptr_t)file >> 4) * 31 + (unsigned)block * 2654435761u) & poolBucketMask);
+}
+
+static int poolFind(IOStats *file, int block)
+{
+    int f = poolBuckets[poolBucket(file, block)];
+    while (f >= 0 && (poolFrames[f].file != file || poolFrames[f].block != block)) f = poolFrames[f].next;
+    return f;
+}
+
+static void poolUnlink(int f)
+{
+    int *link = &poolBuckets[poolBucket(poolFrames[f].file, poolFrames[f].block)];
+    while (*link != f) link = &poolFrames[*link].next;
+    *link = poolFrames[f].next;
+    poolFrames[f].file = NULL;
+}
+
+//--- Write-back handle of a file, opened once and kept in its entry (the file may be closed); NULL if it was removed ---//
+static FILE *poolHandleOf(IOStats *file)
+{
+    FileStats *owner = entryOf(file);
+    if (owner->poolHandle == NULL) {
+        FILE *f = fopen(owner->name, "rb+");
+        if (f == NULL) return NULL;
+        if (poolHandleCount == POOL_HANDLES) { // the least recently used handle makes room
+            int lru = 0;
+            for (int h = 1; h < poolHandleCount; h++) {
+                if (poolHandles[h]->poolHandleUse < poolHandles[lru]->poolHandleUse) lru = h;
+            }
+            fclose(poolHandles[lru]->poolHandle);
+            poolHandles[lru]->poolHandle = NULL;
+            poolHandles[lru] = poolHandles[--poolHandleCount];
         }
+        owner->poolHandle = f;
+        poolHandles[poolHandleCount++] = owner;
     }
+    owner->poolHandleUse = ++poolTick;
+    return owner->poolHandle;
+}
 
-    if (i > nbBlocks) allocateBlock(&file); // Allocate new block if needed
+//--- The file is recreated or removed: its write-back handle is closed ---//
+static void poolCloseHandle(IOStats *file)
+{
+    FileStats *owner = entryOf(file);
+    if (owner->poolHandle == NULL) return;
+    fclose(owner->poolHandle);
+    owner->poolHandle = NULL;
+    for (int h = 0; h < poolHandleCount; h++) {
+        if (poolHandles[h] == owner) {
+            poolHandles[h] = poolHandles[--poolHandleCount];
+            break;
+        }
+    }
+}
 
-    readBlock(file, i, &buffer);
-    buffer.T[j] = record;
-    buffer.nb_rec++;
-    writeBlock(file, i, buffer);
-    file.header.nb_rec++;
+//--- Write a dirty frame to its file ---//
+static void poolWriteBack(int f)
+{
+    PoolFrame *frame = &poolFrames[f];
+    FILE *out = poolHandleOf(frame->file);
+    if (out != NULL) { // a file removed since is simply dropped
+        sysWriteAt(out, &frame->data, sizeof(Tblock), blockOffset(frame->block));
+        STAT_ADD(frame->file, blockWrites, 1);
+        STAT_ADD(frame->file, bytesWritten, sizeof(Tblock));
+    }
+    frame->dirty = 0;
+    poolStats.writeBacks++;
+}
 
-    close(file);
-    printf("Your record has been added successfully\n");
+static void poolLink(int f, IOStats *file, int block)
+{
+    PoolFrame *frame = &poolFrames[f];
+    int b = poolBucket(file, block);
+    frame->file = file;
+    frame->block = block;
+    frame->dirty = 0;
+    frame->referenced = 1;
+    frame->next = poolBuckets[b];
+    poolBuckets[b] = f;
 }
 
+//--- Frame for (file, block): CLOCK picks a victim, written back if dirty ---//
+static int poolSlot(IOStats *file, int block)
+{
+    while (1) {
+        PoolFrame *frame = &poolFrames[poolHand];
+        int f = poolHand;
+        poolHand = (poolHand + 1) % poolSize;
+        if (frame->file != NULL && frame->referenced) {
+            frame->referenced = 0;
+            continue;
+        }
+        if (frame->file != NULL) {
+            if (frame->dirty) poolWriteBack(f);
+            poolUnlink(f);
+            poolStats.evictions++;
+        }
+        poolLink(f, file, block);
+        return f;
+    }
+}
 
-void deleteTnOFphy(const char *filename, int key) //--- Physical deletion procedure ---//
+//--- Frame for a block read by a sequential scan: the frame of its previous block if still clean and unreferenced ---//
+static int poolScanSlot(FileStats *owner, IOStats *file, int block)
 {
-    int i, j,found;
-    searchTnOF(key, filename,&found, &i, &j);
-    printf("%d %d\n",i,j);
+    int f = owner->poolScanFrame;
+    if (f < poolSize && poolFrames[f].file == file && poolFrames[f].block == block - 1 && !poolFrames[f].dirty
+        && !poolFrames[f].referenced) {
+        poolUnlink(f);
+        poolStats.evictions++;
+        poolLink(f, file, block);
+    } else f = poolSlot(file, block);
+    poolFrames[f].referenced = 0; // first in line for eviction
+    owner->poolScanFrame = f;
+    return f;
+}
 
-    if (found)
-    {
-        TnOF file;
-        Tblock buffer;
-        Record temp;
-        open(&file, filename, 'o');
+static void poolRead(TnOF file, int i, Tblock *buf)
+{
+    pthread_mutex_lock(&poolLock);
+    FileStats *owner = entryOf(file.stats);
+    owner->poolRun = (i == owner->poolNextBlock) ? owner->poolRun + 1 : 0;
+    owner->poolNextBlock = i + 1;
+    int scanning = owner->poolRun >= POOL_SCAN_RUN;
+    int f = poolFind(file.stats, i);
+    if (f >= 0) {
+        poolStats.hits++;
+        if (!scanning) poolFrames[f].referenced = 1; // a scan does not promote what it passes over
+    } else {
+        poolStats.misses++;
+        f = scanning ? poolScanSlot(owner, file.stats, i) : poolSlot(file.stats, i);
+        sysReadAt(file.f, &poolFrames[f].data, sizeof(Tblock), blockOffset(i));
+        STAT_ADD(file.stats, blockReads, 1);
+        STAT_ADD(file.stats, bytesRead, sizeof(Tblock));
+    }
+    *buf = poolFrames[f].data;
+    pthread_mutex_unlock(&poolLock);
+}
 
-        readBlock(file, getHeader(file,1), &buffer);
-        temp = buffer.T[buffer.nb_rec-1]; //get the last record
-        buffer.nb_rec--;
-        file.header.nb_rec = file.header.nb_rec - 1;
+static void poolWrite(TnOF file, int i, const Tblock *buf)
+{
+    pthread_mutex_lock(&poolLock);
+    int f = poolFind(file.stats, i);
+    if (f >= 0) {
+        poolStats.hits++;
+        poolFrames[f].referenced = 1;
+    } else {
+        f = poolSlot(file.stats, i); // the whole block is overwritten, nothing to read
+    }
+    poolFrames[f].data = *buf;
+    poolFrames[f].dirty = 1;
+    pthread_mutex_unlock(&poolLock);
+}
 
-        if (buffer.nb_rec == 0) //--- If a block becomes empty ---//
-        {
-            file.header.nb_block = file.header.nb_block - 1;
-        }else{
-            writeBlock(file, getHeader(file,1), buffer);
+//--- Drop the frames of a file from block first on, without writing them ---//
+static void poolDropFrom(IOStats *file, int first)
+{
+    if (poolSize == 0) return;
+    pthread_mutex_lock(&poolLock);
+    for (int f = 0; f < poolSize; f++) {
+        if (poolFrames[f].file == file && poolFrames[f].block >= first) poolUnlink(f);
+    }
+    if (first <= 1) poolCloseHandle(file); // the file is recreated or removed
+    pthread_mutex_unlock(&poolLock);
+}
+
+//--- Write back the dirty frames of one file (NULL: of every file) ---//
+static void poolFlush(IOStats *file)
+{
+    if (poolSize == 0) return;
+    pthread_mutex_lock(&poolLock);
+    for (int f = 0; f < poolSize; f++) {
+        if (poolFrames[f].file == NULL || !poolFrames[f].dirty) continue;
+        if (file != NULL && poolFrames[f].file != file) continue;
+
+        IOStats *owner = poolFrames[f].file;
+        for (int g = f; g < poolSize; g++) {
+            if (poolFrames[g].file == owner && poolFrames[g].dirty) poolWriteBack(g);
         }
+    }
+    pthread_mutex_unlock(&poolLock);
+}
+
+void flushBufferPool()
+{
+    poolFlush(NULL);
+}
 
-        readBlock(file, i, &buffer);
-        buffer.T[j]=temp; //replace the record you want to delete with the last record
-        writeBlock(file, i, buffer);
+PoolStats getPoolStats()
+{
+    poolStats.frames = poolSize;
+    return poolStats;
+}
+
+void setBufferPool(int frames)
+{
+    static int exitHook = 0;
+    flushBufferPool();
+    pthread_mutex_lock(&poolLock);
+    while (poolHandleCount > 0) poolCloseHandle(&poolHandles[0]->stats);
+    free(poolFrames);
+    free(poolBuckets);
+    poolFrames = NULL;
+    poolBuckets = NULL;
+    poolSize = 0;
+    poolHand = 0;
+    if (frames > 0) {
+        int buckets = 1;
+        while (buckets < frames) buckets *= 2;
+        poolFrames = calloc(frames, sizeof(PoolFrame));
+        poolBuckets = malloc(buckets * sizeof(int));
+        for (int b = 0; b < buckets; b++) poolBuckets[b] = -1;
+        poolBucketMask = buckets - 1;
+        poolSize = frames;
+        if (!exitHook) {
+            atexit(flushBufferPool); // dirty frames must reach the disk before the program ends
+            exitHook = 1;
+        }
+    }
+    memset(&poolStats, 0, sizeof(PoolStats));
+    pthread_mutex_unlock(&poolLock);
+}
+
+//--- Map the whole file, falling back to stdio if the mapping fails ---//
+static void mapFile(TnOF *file)
+{
+    fseek(file->f, 0, SEEK_END);
+    file->mapSize = ftell(file->f);
+    file->map = sysMap(file->f, file->mapSize);
+}
+
+//--- Make sure the mapping covers nbBlocks blocks: ftruncate + remap, doubling the size ---//
+static void growMap(TnOF *file, int nbBlocks)
+{
+    long needed = blockOffset(nbBlocks + 1);
+    if (needed <= file->mapSize) return;
+
+    long newSize = file->mapSize * 2;
+    if (newSize < needed) newSize = needed;
+    sysUnmap(file->map, file->mapSize);
+    sysResize(file->f, newSize);
+    file->mapSize = newSize;
+    file->map = sysMap(file->f, newSize);
+}
+
+static Tblock *mappedBlock(TnOF file, int i)
+{
+    return (Tblock *)(file.map + blockOffset(i));
+}
+
+//--- Bloom filter sidecar "<file>.bloom": one filter for the file, optionally one per block ---//
+// Only loading and additions live here, they are needed by open/close and the append paths;
+// lookups, which may rebuild the filter from the data blocks, come after the hash index.
+
+typedef struct BloomHeader
+{
+    long bits;
+    int blockBits;
+    int nbBlocks;
+    int keys;
+    int deletes;
+    int stale;
+}BloomHeader;
+
+static int bloomMode = BLOOM_OFF;
+
+void setBloomFilters(int mode)
+{
+    bloomMode = mode;
+}
+
+int getBloomFilters()
+{
+    return bloomMode;
+}
+
+static void bloomName(char *dst, size_t size, const char *filename)
+{
+    formatName(dst, size, "%s.bloom", filename);
+}
+
+void dropBloom(const char *filename)
+{
+    char name[PATH_MAX];
+    bloomName(name, sizeof(name), filename);
+    remove(name);
+}
+
+static uint64_t bloomHash(int key) // splitmix64: the two halves drive the double hashing
+{
+    uint64_t h = (uint32_t)key + 0x9E3779B97F4A7C15ull;
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+    return h ^ (h >> 31);
+}
+
+//--- Pages of a filter: size bytes at offset in the sidecar, all loaded (and zero) for a new filter ---//
+static void initPages(BloomPages *pages, long size, long offset, int loaded)
+{
+    long count = (size + BLOOM_PAGE - 1) / BLOOM_PAGE;
+    pages->bytes = calloc(size + 1, 1);
+    pages->size = size;
+    pages->offset = offset;
+    pages->state = calloc(count + 1, 1);
+    if (loaded) memset(pages->state, BLOOM_PAGE_LOADED, count);
+}
+
+//--- Byte of a filter, its page read from the sidecar first if needed ---//
+static unsigned char *pageByte(BloomFilter *bloom, BloomPages *pages, long byte)
+{
+    long page = byte / BLOOM_PAGE;
+    if (!(pages->state[page] & BLOOM_PAGE_LOADED)) {
+        long first = page * BLOOM_PAGE;
+        long length = pages->size - first < BLOOM_PAGE ? pages->size - first : BLOOM_PAGE;
+        if (bloom->sidecar == NULL || sysReadAt(bloom->sidecar, pages->bytes + first, length, pages->offset + first) != length)
+            bloom->stale = 1; // lost or cut short: rebuilt before the next lookup
+        pages->state[page] |= BLOOM_PAGE_LOADED;
+    }
+    return &pages->bytes[byte];
+}
+
+//--- Bits of a filter of size bits starting at byte base of pages: file filter at 0, block filter i at its own base ---//
+static void bloomSet(BloomFilter *bloom, BloomPages *pages, long base, long size, uint64_t h, int hashes)
+{
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+    for (int k = 0; k < hashes; k++) {
+        long bit = (h1 + (uint64_t)k * h2) & (size - 1);
+        long byte = base + (bit >> 3);
+        *pageByte(bloom, pages, byte) |= 1 << (bit & 7);
+        pages->state[byte / BLOOM_PAGE] |= BLOOM_PAGE_DIRTY;
+    }
+    bloom->dirty = 1;
+}
+
+static int bloomTest(BloomFilter *bloom, BloomPages *pages, long base, long size, uint64_t h, int hashes)
+{
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+    for (int k = 0; k < hashes; k++) {
+        long bit = (h1 + (uint64_t)k * h2) & (size - 1);
+        if (!(*pageByte(bloom, pages, base + (bit >> 3)) & (1 << (bit & 7)))) return 0;
+    }
+    return 1;
+}
+
+static long bloomSize(long keys, int bitsPerKey) // power of two, at least 64 bits
+{
+    long size = 64;
+    while (size < keys * bitsPerKey) size *= 2;
+    return size;
+}
+
+static BloomFilter *newBloom(int keys, int blockCapacity, int nbBlocks, int withBlocks)
+{
+    BloomFilter *bloom = calloc(1, sizeof(BloomFilter));
+    bloom->keys = keys;
+    bloom->bits = bloomSize(keys, BLOOM_BITS_PER_KEY);
+    if (withBlocks) {
+        bloom->blockBits = (int)bloomSize(blockCapacity, BLOOM_BLOCK_BITS_PER_KEY);
+        bloom->nbBlocks = nbBlocks;
+    }
+    initPages(&bloom->filter, bloom->bits / 8, sizeof(BloomHeader), 1);
+    initPages(&bloom->blockFilters, (long)bloom->nbBlocks * bloom->blockBits / 8, sizeof(BloomHeader) + bloom->bits / 8, 1);
+    bloom->dirty = 1;
+    bloom->rewrite = 1;
+    return bloom;
+}
+
+static void freeBloom(BloomFilter *bloom)
+{
+    if (bloom == NULL) return;
+    if (bloom->sidecar != NULL) fclose(bloom->sidecar);
+    free(bloom->filter.bytes);
+    free(bloom->filter.state);
+    free(bloom->blockFilters.bytes);
+    free(bloom->blockFilters.state);
+    free(bloom);
+}
+
+static BloomFilter *loadBloom(const char *filename)
+{
+    char name[PATH_MAX];
+    bloomName(name, sizeof(name), filename);
+    FILE *f = fopen(name, "r+b"); // kept open: pages are read on first use and written back in place
+    if (f == NULL) f = fopen(name, "rb");
+    if (f == NULL) return NULL;
+    BloomHeader h;
+    if (fread(&h, sizeof(BloomHeader), 1, f) != 1 || h.bits < 64 || (h.bits & (h.bits - 1)) != 0 || h.blockBits < 0
+        || h.nbBlocks < 0) {
+        fclose(f);
+        return NULL;
+    }
+    BloomFilter *bloom = calloc(1, sizeof(BloomFilter));
+    bloom->bits = h.bits;
+    bloom->blockBits = h.blockBits;
+    bloom->nbBlocks = h.nbBlocks;
+    bloom->keys = h.keys;
+    bloom->deletes = h.deletes;
+    bloom->stale = h.stale;
+    bloom->sidecar = f;
+    initPages(&bloom->filter, h.bits / 8, sizeof(BloomHeader), 0);
+    initPages(&bloom->blockFilters, (long)h.nbBlocks * h.blockBits / 8, sizeof(BloomHeader) + h.bits / 8, 0);
+    return bloom; // no page read yet
+}
+
+//--- Filter of an open file, read on first use; NULL if the file has none ---//
+static BloomFilter *bloomOf(TnOF *file)
+{
+    if (!file->bloomLoaded) {
+        file->bloom = loadBloom(fileNameOf(file->stats));
+        file->bloomLoaded = 1;
+    }
+    return file->bloom;
+}
+
+static void writeDirtyPages(FILE *f, BloomPages *pages)
+{
+    long count = (pages->size + BLOOM_PAGE - 1) / BLOOM_PAGE;
+    for (long page = 0; page < count; page++) {
+        if (!(pages->state[page] & BLOOM_PAGE_DIRTY)) continue;
+        long first = page * BLOOM_PAGE;
+        long length = pages->size - first < BLOOM_PAGE ? pages->size - first : BLOOM_PAGE;
+        sysWriteAt(f, pages->bytes + first, length, pages->offset + first);
+        pages->state[page] &= ~BLOOM_PAGE_DIRTY;
+    }
+}
+
+//--- Written back by close() when changed: the header and the changed pages, or the whole sidecar for a new filter ---//
+static void saveBloom(TnOF *file)
+{
+    BloomFilter *bloom = file->bloom;
+    BloomHeader h = {bloom->bits, bloom->blockBits, bloom->nbBlocks, bloom->keys, bloom->deletes, bloom->stale};
+    if (bloom->rewrite) {
+        char name[PATH_MAX];
+        bloomName(name, sizeof(name), fileNameOf(file->stats));
+        FILE *f = fopen(name, "wb");
+        if (f == NULL) return;
+        fwrite(&h, sizeof(BloomHeader), 1, f);
+        fwrite(bloom->filter.bytes, 1, bloom->filter.size, f);
+        fwrite(bloom->blockFilters.bytes, 1, bloom->blockFilters.size, f);
+        fclose(f);
+        bloom->rewrite = 0;
+        return;
+    }
+    if (bloom->sidecar == NULL) return;
+    sysWriteAt(bloom->sidecar, &h, sizeof(BloomHeader), 0);
+    writeDirtyPages(bloom->sidecar, &bloom->filter);
+    writeDirtyPages(bloom->sidecar, &bloom->blockFilters);
+}
+
+//--- Record key now lives in block: set its bits in the file filter and in the block filter ---//
+static void bloomAdd(TnOF *file, int key, int block)
+{
+    BloomFilter *bloom = bloomOf(file);
+    if (bloom == NULL || bloom->stale) return; // a stale filter is rebuilt from the blocks anyway
+    uint64_t h = bloomHash(key);
+    bloomSet(bloom, &bloom->filter, 0, bloom->bits, h, BLOOM_HASHES);
+    if (bloom->blockBits == 0 || bloom->stale) return;
+    BloomPages *blocks = &bloom->blockFilters;
+    if (block > bloom->nbBlocks) { // the new block filters extend the sidecar, they are empty and dirty
+        if (blocks->size > 0) pageByte(bloom, blocks, blocks->size - 1); // the old last page is read before it grows
+        long oldCount = (blocks->size + BLOOM_PAGE - 1) / BLOOM_PAGE;
+        int nbBlocks = bloom->nbBlocks * 2 > block ? bloom->nbBlocks * 2 : block;
+        long newSize = (long)nbBlocks * bloom->blockBits / 8;
+        long newCount = (newSize + BLOOM_PAGE - 1) / BLOOM_PAGE;
+        blocks->bytes = realloc(blocks->bytes, newSize + 1);
+        memset(blocks->bytes + blocks->size, 0, newSize + 1 - blocks->size);
+        blocks->state = realloc(blocks->state, newCount + 1);
+        memset(blocks->state + oldCount, BLOOM_PAGE_LOADED | BLOOM_PAGE_DIRTY, newCount + 1 - oldCount);
+        if (oldCount > 0) blocks->state[oldCount - 1] |= BLOOM_PAGE_DIRTY;
+        blocks->size = newSize;
+        bloom->nbBlocks = nbBlocks;
+    }
+    bloomSet(bloom, blocks, (long)(block - 1) * bloom->blockBits / 8, bloom->blockBits, h, BLOOM_BLOCK_HASHES);
+}
+
+static void bloomAddBlock(TnOF *file, const Tblock *buf, int block)
+{
+    if (bloomOf(file) == NULL) return;
+    for (int j = 0; j < buf->nb_rec; j++) bloomAdd(file, buf->T[j].key, block);
+}
+
+//--- Start an empty filter for a file being filled (partition fragments, bulk loads) ---//
+static void attachBloom(TnOF *file, int keys)
+{
+    if (bloomMode == BLOOM_OFF) return;
+    freeBloom(file->bloom);
+    file->bloom = newBloom(keys > 0 ? keys : 1, file->header.blockCapacity, file->header.nb_block,
+                           bloomMode == BLOOM_BLOCK);
+    file->bloomLoaded = 1;
+}
+
+static int validHeader(const Header *header)
+{
+    return header->magic == TNOF_MAGIC && header->version == TNOF_VERSION && header->blockSize == BLOCK_SIZE
+        && (header->encoding == ENCODING_RAW || header->encoding == ENCODING_PACKED);
+}
+
+//--- Packed files: blocks of any size after the header page, then their offsets (nb_block + 1 longs) at the end ---//
+
+static int blockEncoding = ENCODING_RAW;
+
+void setBlockEncoding(int encoding)
+{
+    blockEncoding = encoding == ENCODING_PACKED ? ENCODING_PACKED : ENCODING_RAW;
+}
+
+int getBlockEncoding()
+{
+    return blockEncoding;
+}
+
+//--- Packed blocks: frame of reference, then key - base on bits bits, rows of PACK_LANES keys across the lanes ---//
+
+static int packedWords(int nbRec, int bits) // words of each lane
+{
+    int rows = (nbRec + PACK_LANES - 1) / PACK_LANES;
+    return (rows * bits + 31) / 32;
+}
+
+static long packedSize(const PackedBlock *packed)
+{
+    return sizeof(PackedBlock) + (long)packedWords(packed->nb_rec, packed->bits) * PACK_LANES * sizeof(unsigned int);
+}
+
+static long packBlock(const Tblock *block, PackedBlock *out)
+{
+    int n = block->nb_rec;
+    int min = n > 0 ? block->T[0].key : 0, max = min;
+    for (int j = 1; j < n; j++) {
+        if (block->T[j].key < min) min = block->T[j].key;
+        if (block->T[j].key > max) max = block->T[j].key;
+    }
+    unsigned int range = (unsigned int)max - (unsigned int)min;
+    out->nb_rec = n;
+    out->base = min;
+    out->bits = range == 0 ? 0 : 32 - __builtin_clz(range);
+    memset(out->words, 0, (long)packedWords(n, out->bits) * PACK_LANES * sizeof(unsigned int));
+    if (out->bits == 0) return packedSize(out);
+    for (int j = 0; j < n; j++) {
+        unsigned int value = (unsigned int)block->T[j].key - (unsigned int)min;
+        int bit = (j / PACK_LANES) * out->bits, shift = bit & 31;
+        unsigned int *word = &out->words[(bit >> 5) * PACK_LANES + j % PACK_LANES];
+        word[0] |= value << shift;
+        if (shift + out->bits > 32) word[PACK_LANES] |= value >> (32 - shift); // continues in the next word of the lane
+    }
+    return packedSize(out);
+}
+
+static void unpackBlock(const PackedBlock *packed, long size, Tblock *out); // with the probe kernels
+static void closeIndex(HashIndex *idx); // with the hash index
+
+//--- Directory of a packed file, read from its end; NULL if it does not describe the header's blocks ---//
+static long *loadDirectory(FILE *f, const Header *header)
+{
+    long entries = (long)header->nb_block + 1;
+    fseek(f, 0, SEEK_END);
+    long at = ftell(f) - entries * (long)sizeof(long);
+    if (at < blockOffset(1)) return NULL;
+    long *directory = malloc(entries * sizeof(long));
+    int valid = sysReadAt(f, directory, entries * sizeof(long), at) == entries * (long)sizeof(long)
+        && directory[0] == blockOffset(1) && directory[entries - 1] == at;
+    for (long b = 1; valid && b < entries; b++) { // bounded blocks: a read never overruns its buffer
+        valid = directory[b] >= directory[b - 1] + (long)sizeof(PackedBlock) && directory[b] - directory[b - 1] <= PACKED_MAX_SIZE;
+    }
+    if (!valid) {
+        free(directory);
+        return NULL;
+    }
+    return directory;
+}
+
+//--- Blocks [first, first + count - 1] of a packed file with a single read into scratch (count x PACKED_MAX_SIZE bytes) ---//
+// Returns the bytes read, -1 on a short read (out is then left as it was).
+static long readPacked(FILE *f, const long *directory, int first, int count, void *scratch, Tblock *out)
+{
+    long from = directory[first - 1], size = directory[first - 1 + count] - from;
+    if (sysReadAt(f, scratch, size, from) != size) return -1;
+    for (int b = 0; b < count; b++) {
+        const char *packed = (const char *)scratch + (directory[first - 1 + b] - from);
+        unpackBlock((const PackedBlock *)packed, directory[first + b] - directory[first - 1 + b], &out[b]);
+    }
+    return size;
+}
+
+//--- Append count blocks to a packed file with a single write; close() writes the directory after them ---//
+static long appendPacked(TnOF *file, const Tblock *bufs, int count)
+{
+    int nbBlocks = file->header.nb_block;
+    if (nbBlocks + count + 1 > file->directorySize) {
+        file->directorySize = 2 * file->directorySize > nbBlocks + count + 1 ? 2 * file->directorySize : nbBlocks + count + 1;
+        file->directory = realloc(file->directory, file->directorySize * sizeof(long));
+    }
+    char *out = malloc(count * PACKED_MAX_SIZE);
+    long size = 0;
+    for (int b = 0; b < count; b++) {
+        size += packBlock(&bufs[b], (PackedBlock *)(out + size)); // sizes are multiples of 4: the next block stays aligned
+        file->directory[nbBlocks + b + 1] = file->directory[nbBlocks] + size;
+    }
+    sysWriteAt(file->f, out, size, file->directory[nbBlocks]);
+    free(out);
+    file->header.nb_block += count;
+    file->directoryDirty = 1;
+    return size;
+}
+
+//--- A new, empty file switched to ENCODING_PACKED: it is filled by appendBlock() / appendBlocks() only ---//
+static void startPacked(TnOF *file)
+{
+    if (file->map != NULL) { // packed blocks are read and decoded, never accessed in place
+        sysUnmap(file->map, file->mapSize);
+        file->map = NULL;
+        file->mapSize = 0;
+    }
+    file->header.encoding = ENCODING_PACKED;
+    file->directorySize = 1024;
+    file->directory = malloc(file->directorySize * sizeof(long));
+    file->directory[0] = blockOffset(1);
+    file->directoryDirty = 1;
+}
+
+//--- Packed files are only appended to: the operations that rewrite blocks in place refuse them ---//
+static int refusePacked(TnOF *file)
+{
+    if (file->header.encoding != ENCODING_PACKED) return 0;
+    printf("Error: '%s' is packed and cannot be updated in place, unpack it first\n", fileNameOf(file->stats));
+    return 1;
+}
+
+void open(TnOF *file, const char *filename, const char mode) 
+{
+    long start = timerStart();
+    file->map = NULL;
+    file->mapSize = 0;
+    file->stats = statsOf(filename);
+    acquireFile(file->stats);
+    file->bloom = NULL;
+    file->bloomLoaded = (mode != 'o'); // a new file has no filter
+    file->index.f = NULL;
+    file->indexLoaded = (mode != 'o'); // nor an index
+    file->directory = NULL;
+    file->directorySize = 0;
+    file->directoryDirty = 0;
+    if (mode == 'o')
+    {
+        file->f = fopen(filename, "rb+");
+        STAT_ADD(file->stats, opens, 1);
+        if (file->f == NULL) {
+            releaseFile(file->stats);
+            return;
+        }
+        size_t got = fread(&(file->header), sizeof(Header), 1, file->f);
+        STAT_ADD(file->stats, headerReads, 1);
+        STAT_ADD(file->stats, bytesRead, sizeof(Header));
+        if (got != 1 || !validHeader(&file->header)) {
+            printf("Error: '%s' is not a TnOF v%d file with %d-byte blocks\n", filename, TNOF_VERSION, BLOCK_SIZE);
+            fclose(file->f);
+            file->f = NULL;
+            releaseFile(file->stats);
+            return;
+        }
+        if (file->header.encoding == ENCODING_PACKED) {
+            file->directory = loadDirectory(file->f, &file->header);
+            if (file->directory == NULL) {
+                printf("Error: The block directory of the packed file '%s' is damaged\n", filename);
+                fclose(file->f);
+                file->f = NULL;
+                releaseFile(file->stats);
+                return;
+            }
+            file->directorySize = file->header.nb_block + 1;
+            STAT_ADD(file->stats, bytesRead, (long)file->directorySize * sizeof(long));
+        }
+        if (file->header.tombstones > 0) {
+            pthread_mutex_lock(&handlesLock);
+            entryOf(file->stats)->tombstoned = 1; // left by an earlier run: the compactor takes it too
+            pthread_mutex_unlock(&handlesLock);
+        }
+    }
+    else 
+    {
+        dropIndex(filename); // the index of a previous file with this name is stale
+        dropBloom(filename);
+        file->f = fopen(filename, "wb+");
+        STAT_ADD(file->stats, opens, 1);
+        if (file->f == NULL) {
+            releaseFile(file->stats);
+            return;
+        }
+        file->header.nb_block = 0;
+        file->header.nb_rec = 0;
+        file->header.magic = TNOF_MAGIC;
+        file->header.version = TNOF_VERSION;
+        file->header.blockSize = BLOCK_SIZE;
+        file->header.sorted = 0;
+        file->header.subFragments = 0;
+        file->header.tombstones = 0;
+        file->header.encoding = ENCODING_RAW; // see startPacked()
+        fwrite(&(file->header), sizeof(Header), 1, file->f);
+        STAT_ADD(file->stats, headerWrites, 1);
+        STAT_ADD(file->stats, bytesWritten, sizeof(Header));
+    }
+    if (mode != 'o') poolDropFrom(file->stats, 1); // frames of a previous file with this name
+    if (currentBackend == BACKEND_MMAP && file->directory == NULL) {
+        // the mapping replaces the pool for this file
+        poolFlush(file->stats);
+        poolDropFrom(file->stats, 1);
+        mapFile(file);
+    }
+    STAT_TIME(file->stats, openNanos, start);
+}
+
+void close(TnOF file) 
+{
+    long start = timerStart();
+    if (file.bloom != NULL && file.bloom->dirty) saveBloom(&file);
+    freeBloom(file.bloom);
+    if (file.index.f != NULL) closeIndex(&file.index);
+    STAT_ADD(file.stats, headerWrites, 1);
+    STAT_ADD(file.stats, bytesWritten, sizeof(Header));
+    STAT_ADD(file.stats, closes, 1);
+    if (file.directory != NULL) {
+        if (file.directoryDirty) { // after the last block, then the file ends there
+            long end = file.directory[file.header.nb_block], size = (file.header.nb_block + 1) * (long)sizeof(long);
+            sysWriteAt(file.f, file.directory, size, end);
+            sysResize(file.f, end + size);
+            STAT_ADD(file.stats, bytesWritten, size);
+        }
+        free(file.directory);
+    }
+    if (file.map != NULL)
+    {
+        // write the header in place, then drop the slack left by growMap
+        memcpy(file.map, &(file.header), sizeof(Header));
+        sysUnmap(file.map, file.mapSize);
+        sysResize(file.f, blockOffset(file.header.nb_block + 1));
+        fclose(file.f);
+        STAT_TIME(file.stats, closeNanos, start);
+        releaseFile(file.stats);
+        return;
+    }
+    rewind(file.f);
+    STAT_ADD(file.stats, seeks, 1);
+    fwrite(&(file.header), sizeof(Header), 1, file.f);
+    fclose(file.f);
+    file.f = NULL;
+    STAT_TIME(file.stats, closeNanos, start);
+    releaseFile(file.stats);
+}
+
+int readBlock(TnOF file, int i, Tblock *buf)
+{
+    if ((i > file.header.nb_block) || (i < 1)) return 0; 
+    long start = timerStart();
+    if (file.directory != NULL) { // the pool and the mapping hold raw blocks only
+        long scratch[PACKED_MAX_SIZE / sizeof(long) + 1];
+        long got = readPacked(file.f, file.directory, i, 1, scratch, buf);
+        if (got < 0) buf->nb_rec = 0;
+        STAT_ADD(file.stats, blockReads, 1);
+        STAT_ADD(file.stats, bytesRead, got > 0 ? got : 0);
+        STAT_TIME(file.stats, readNanos, start);
+        return 1;
+    }
+    if (file.map != NULL) {
+        STAT_ADD(file.stats, blockReads, 1);
+        STAT_ADD(file.stats, bytesRead, sizeof(Tblock));
+        *buf = *mappedBlock(file, i);
+        STAT_TIME(file.stats, readNanos, start);
+        return 1;
+    }
+    if (poolSize > 0) {
+        poolRead(file, i, buf);
+        STAT_TIME(file.stats, readNanos, start);
+        return 1;
+    }
+    STAT_ADD(file.stats, blockReads, 1);
+    STAT_ADD(file.stats, bytesRead, sizeof(Tblock));
+    fseek(file.f, blockOffset(i), 0);
+    STAT_ADD(file.stats, seeks, 1);
+    fread(buf, sizeof(Tblock), 1, file.f);
+    STAT_TIME(file.stats, readNanos, start);
+    return 1;
+}
+
+const Tblock *peekBlock(TnOF file, int i, Tblock *buf)
+{
+    if ((i > file.header.nb_block) || (i < 1)) return NULL;
+    if (file.map != NULL) {
+        STAT_ADD(file.stats, blockReads, 1); // read in place: no copy, no time worth measuring
+        return mappedBlock(file, i);
+    }
+    readBlock(file, i, buf);
+    return buf;
+}
+
+int writeBlock(TnOF file, int i, Tblock buf) 
+{
+    if ((i > file.header.nb_block) || (i < 1) || file.directory != NULL) return 0; // packed blocks are never rewritten
+    long start = timerStart();
+    if (poolSize > 0 && file.map == NULL) {
+        poolWrite(file, i, &buf); // counted as a block write when written back
+        STAT_TIME(file.stats, writeNanos, start);
+        return 0;
+    }
+    STAT_ADD(file.stats, blockWrites, 1);
+    STAT_ADD(file.stats, bytesWritten, sizeof(Tblock));
+    if (file.map != NULL) {
+        *mappedBlock(file, i) = buf;
+        STAT_TIME(file.stats, writeNanos, start);
+        return 0;
+    }
+    fseek(file.f, blockOffset(i), 0);
+    STAT_ADD(file.stats, seeks, 1);
+    fwrite(&buf, sizeof(Tblock), 1, file.f);
+    STAT_TIME(file.stats, writeNanos, start);
+    return 0;
+}
+
+int getHeader(TnOF file, int i) {
+    switch(i)
+    {
+        case 1:
+            return file.header.nb_block; 
+        case 2:   
+            return file.header.nb_rec; 
+        case 3:
+            return file.header.blockCapacity; 
+        default:
+            return 0;
+    }
+}
+
+void allocateBlock(TnOF *file) 
+{
+    if (file->directory != NULL) return; // packed: appendBlock() writes the block with its records
+    long start = timerStart();
+    if (file->map != NULL) growMap(file, file->header.nb_block + 1);
+    if (file->map != NULL) {
+        file->header.nb_block++;
+        mappedBlock(*file, file->header.nb_block)->nb_rec = 0;
+        STAT_TIME(file->stats, writeNanos, start);
+        return;
+    }
+    Tblock newBlock;
+    newBlock.nb_rec = 0;
+    if (poolSize > 0) {
+        file->header.nb_block++;
+        poolWrite(*file, file->header.nb_block, &newBlock);
+        STAT_TIME(file->stats, writeNanos, start);
+        return;
+    }
+    // not SEEK_END: the physical end may hold blocks freed by a deletion
+    fseek(file->f, blockOffset(file->header.nb_block + 1), 0);
+    fwrite(&newBlock, sizeof(Tblock), 1, file->f);
+    file->header.nb_block++;
+    STAT_ADD(file->stats, seeks, 1);
+    STAT_ADD(file->stats, blockWrites, 1);
+    STAT_ADD(file->stats, bytesWritten, sizeof(Tblock));
+    STAT_TIME(file->stats, writeNanos, start);
+}
+
+int appendBlock(TnOF *file, Tblock buf)
+{
+    bloomAddBlock(file, &buf, file->header.nb_block + 1);
+    long start = timerStart();
+    if (file->directory != NULL) {
+        long size = appendPacked(file, &buf, 1);
+        STAT_ADD(file->stats, blockWrites, 1);
+        STAT_ADD(file->stats, bytesWritten, size);
+        STAT_TIME(file->stats, writeNanos, start);
+        return file->header.nb_block;
+    }
+    STAT_ADD(file->stats, blockWrites, 1);
+    STAT_ADD(file->stats, bytesWritten, sizeof(Tblock));
+    if (file->map != NULL) growMap(file, file->header.nb_block + 1);
+    if (file->map != NULL) {
+        file->header.nb_block++;
+        *mappedBlock(*file, file->header.nb_block) = buf;
+        STAT_TIME(file->stats, writeNanos, start);
+        return file->header.nb_block;
+    }
+    if (poolSize > 0) {
+        // streaming writes bypass the pool, but an old frame of this position is now stale
+        poolDropFrom(file->stats, file->header.nb_block + 1);
+        sysWriteAt(file->f, &buf, sizeof(Tblock), blockOffset(file->header.nb_block + 1));
+        file->header.nb_block++;
+        STAT_TIME(file->stats, writeNanos, start);
+        return file->header.nb_block;
+    }
+    // seek past the last allocated block (the physical end may hold blocks freed by a deletion)
+    fseek(file->f, blockOffset(file->header.nb_block + 1), 0);
+    fwrite(&buf, sizeof(Tblock), 1, file->f);
+    file->header.nb_block++;
+    STAT_ADD(file->stats, seeks, 1);
+    STAT_TIME(file->stats, writeNanos, start);
+    return file->header.nb_block;
+}
+
+int appendBlocks(TnOF *file, const Tblock *bufs, int count)
+{
+    for (int b = 0; b < count; b++) bloomAddBlock(file, &bufs[b], file->header.nb_block + 1 + b);
+    long start = timerStart();
+    if (file->directory != NULL) {
+        long size = appendPacked(file, bufs, count);
+        STAT_ADD(file->stats, blockWrites, count);
+        STAT_ADD(file->stats, bytesWritten, size);
+        STAT_TIME(file->stats, writeNanos, start);
+        return file->header.nb_block;
+    }
+    STAT_ADD(file->stats, blockWrites, count);
+    STAT_ADD(file->stats, bytesWritten, (long)count * sizeof(Tblock));
+    if (file->map != NULL) growMap(file, file->header.nb_block + count);
+    if (file->map != NULL) {
+        memcpy(mappedBlock(*file, file->header.nb_block + 1), bufs, (long)count * sizeof(Tblock));
+        file->header.nb_block += count;
+        STAT_TIME(file->stats, writeNanos, start);
+        return file->header.nb_block;
+    }
+    if (poolSize > 0) {
+        poolDropFrom(file->stats, file->header.nb_block + 1);
+        sysWriteAt(file->f, bufs, (long)count * sizeof(Tblock), blockOffset(file->header.nb_block + 1));
+        file->header.nb_block += count;
+        STAT_TIME(file->stats, writeNanos, start);
+        return file->header.nb_block;
+    }
+    fseek(file->f, blockOffset(file->header.nb_block + 1), 0);
+    fwrite(bufs, sizeof(Tblock), count, file->f);
+    file->header.nb_block += count;
+    STAT_ADD(file->stats, seeks, 1);
+    STAT_TIME(file->stats, writeNanos, start);
+    return file->header.nb_block;
+}
+
+
+//--- Block probe kernels: find / count a key in the records of a block ---//
+// Record is a single int, so T is a plain int array the kernels compare 8 (AVX2) or 4 (SSE2) keys at a time.
+
+static int probeScalar(const Tblock *block, int key)
+{
+    for (int j = 0; j < block->nb_rec; j++) {
+        if (block->T[j].key == key) return j;
+    }
+    return -1;
+}
+
+static int countScalar(const Tblock *block, int key)
+{
+    int count = 0;
+    for (int j = 0; j < block->nb_rec; j++) {
+        if (block->T[j].key == key) count++;
+    }
+    return count;
+}
+
+//--- Packed block decoders: every lane is at the same bit offset for a row, so a row takes the same shifts on all lanes ---//
+
+//--- Keys [from, nb_rec) one at a time: the last, incomplete row of the SIMD kernels ---//
+static void unpackTail(const PackedBlock *packed, Tblock *out, int from)
+{
+    int bits = packed->bits;
+    unsigned int mask = bits == 32 ? ~0u : (1u << bits) - 1;
+    for (int j = from; j < packed->nb_rec; j++) {
+        int bit = (j / PACK_LANES) * bits, shift = bit & 31;
+        const unsigned int *word = &packed->words[(bit >> 5) * PACK_LANES + j % PACK_LANES];
+        unsigned int value = word[0] >> shift;
+        if (shift + bits > 32) value |= word[PACK_LANES] << (32 - shift);
+        out->T[j].key = (int)((value & mask) + (unsigned int)packed->base);
+    }
+}
+
+static void unpackScalar(const PackedBlock *packed, Tblock *out)
+{
+    unpackTail(packed, out, 0);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static int probeSSE2(const Tblock *block, int key)
+{
+    const int *keys = &block->T[0].key;
+    __m128i k = _mm_set1_epi32(key);
+    int j = 0;
+    for (; j + 4 <= block->nb_rec; j += 4) {
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(keys + j)), k)));
+        if (mask) return j + __builtin_ctz(mask);
+    }
+    for (; j < block->nb_rec; j++) {
+        if (keys[j] == key) return j;
+    }
+    return -1;
+}
+
+__attribute__((target("sse2")))
+static int countSSE2(const Tblock *block, int key)
+{
+    const int *keys = &block->T[0].key;
+    __m128i k = _mm_set1_epi32(key);
+    int count = 0, j = 0;
+    for (; j + 4 <= block->nb_rec; j += 4) {
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(keys + j)), k)));
+        count += __builtin_popcount(mask);
+    }
+    for (; j < block->nb_rec; j++) {
+        if (keys[j] == key) count++;
+    }
+    return count;
+}
+
+__attribute__((target("avx2")))
+static int probeAVX2(const Tblock *block, int key)
+{
+    const int *keys = &block->T[0].key;
+    __m256i k = _mm256_set1_epi32(key);
+    int j = 0;
+    for (; j + 8 <= block->nb_rec; j += 8) {
+        __m256i eq = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(keys + j)), k);
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+        if (mask) return j + __builtin_ctz(mask);
+    }
+    for (; j < block->nb_rec; j++) {
+        if (keys[j] == key) return j;
+    }
+    return -1;
+}
+
+__attribute__((target("avx2")))
+static int countAVX2(const Tblock *block, int key)
+{
+    const int *keys = &block->T[0].key;
+    __m256i k = _mm256_set1_epi32(key);
+    int count = 0, j = 0;
+    for (; j + 8 <= block->nb_rec; j += 8) {
+        __m256i eq = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(keys + j)), k);
+        count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(eq)));
+    }
+    for (; j < block->nb_rec; j++) {
+        if (keys[j] == key) count++;
+    }
+    return count;
+}
+
+__attribute__((target("sse2")))
+static void unpackSSE2(const PackedBlock *packed, Tblock *out)
+{
+    int bits = packed->bits, rows = packed->nb_rec / PACK_LANES;
+    int *keys = &out->T[0].key;
+    __m128i mask = _mm_set1_epi32(bits == 32 ? -1 : (1 << bits) - 1);
+    __m128i base = _mm_set1_epi32(packed->base);
+    for (int r = 0; r < rows; r++) {
+        int bit = r * bits, shift = bit & 31;
+        const unsigned int *word = &packed->words[(bit >> 5) * PACK_LANES];
+        for (int half = 0; half < PACK_LANES; half += 4) {
+            __m128i value = _mm_srl_epi32(_mm_loadu_si128((const __m128i *)(word + half)), _mm_cvtsi32_si128(shift));
+            if (shift + bits > 32) {
+                __m128i next = _mm_loadu_si128((const __m128i *)(word + PACK_LANES + half));
+                value = _mm_or_si128(value, _mm_sll_epi32(next, _mm_cvtsi32_si128(32 - shift)));
+            }
+            _mm_storeu_si128((__m128i *)(keys + r * PACK_LANES + half), _mm_add_epi32(_mm_and_si128(value, mask), base));
+        }
+    }
+    unpackTail(packed, out, rows * PACK_LANES);
+}
+
+__attribute__((target("avx2")))
+static void unpackAVX2(const PackedBlock *packed, Tblock *out)
+{
+    int bits = packed->bits, rows = packed->nb_rec / PACK_LANES;
+    int *keys = &out->T[0].key;
+    __m256i mask = _mm256_set1_epi32(bits == 32 ? -1 : (1 << bits) - 1);
+    __m256i base = _mm256_set1_epi32(packed->base);
+    for (int r = 0; r < rows; r++) {
+        int bit = r * bits, shift = bit & 31;
+        const unsigned int *word = &packed->words[(bit >> 5) * PACK_LANES];
+        __m256i value = _mm256_srl_epi32(_mm256_loadu_si256((const __m256i *)word), _mm_cvtsi32_si128(shift));
+        if (shift + bits > 32) {
+            __m256i next = _mm256_loadu_si256((const __m256i *)(word + PACK_LANES));
+            value = _mm256_or_si256(value, _mm256_sll_epi32(next, _mm_cvtsi32_si128(32 - shift)));
+        }
+        _mm256_storeu_si256((__m256i *)(keys + r * PACK_LANES), _mm256_add_epi32(_mm256_and_si256(value, mask), base));
+    }
+    unpackTail(packed, out, rows * PACK_LANES);
+}
+#endif
+
+static int (*probeKernel)(const Tblock *, int) = NULL;   // chosen on first use, see setProbeKernel()
+static int (*countKernel)(const Tblock *, int) = NULL;
+static void (*unpackKernel)(const PackedBlock *, Tblock *) = NULL;
+static int probeKernelId = PROBE_SCALAR;
+
+int setProbeKernel(int kernel)
+{
+    if (kernel == PROBE_AUTO) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) kernel = PROBE_AVX2;
+        else if (__builtin_cpu_supports("sse2")) kernel = PROBE_SSE2;
+        else kernel = PROBE_SCALAR;
+#else
+        kernel = PROBE_SCALAR;
+#endif
+    }
+    switch (kernel)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        case PROBE_AVX2:
+            __builtin_cpu_init();
+            if (!__builtin_cpu_supports("avx2")) return 0;
+            probeKernel = probeAVX2;
+            countKernel = countAVX2;
+            unpackKernel = unpackAVX2;
+            break;
+        case PROBE_SSE2:
+            __builtin_cpu_init();
+            if (!__builtin_cpu_supports("sse2")) return 0;
+            probeKernel = probeSSE2;
+            countKernel = countSSE2;
+            unpackKernel = unpackSSE2;
+            break;
+#endif
+        case PROBE_SCALAR:
+            probeKernel = probeScalar;
+            countKernel = countScalar;
+            unpackKernel = unpackScalar;
+            break;
+        default:
+            return 0;
+    }
+    probeKernelId = kernel;
+    return 1;
+}
+
+const char *probeKernelName()
+{
+    if (probeKernel == NULL) setProbeKernel(PROBE_AUTO);
+    switch (probeKernelId)
+    {
+        case PROBE_AVX2:
+            return "avx2";
+        case PROBE_SSE2:
+            return "sse2";
+        default:
+            return "scalar";
+    }
+}
+
+int probeBlock(const Tblock *block, int key)
+{
+    if (probeKernel == NULL) setProbeKernel(PROBE_AUTO);
+    return probeKernel(block, key);
+}
+
+int countInBlock(const Tblock *block, int key)
+{
+    if (countKernel == NULL) setProbeKernel(PROBE_AUTO);
+    return countKernel(block, key);
+}
+
+//--- Decode a packed block of size bytes read from disk: an inconsistent one decodes as an empty block ---//
+static void unpackBlock(const PackedBlock *packed, long size, Tblock *out)
+{
+    out->nb_rec = 0;
+    if (size < (long)sizeof(PackedBlock) || packed->nb_rec < 0 || packed->nb_rec > MAX_RECORDS
+        || packed->bits < 0 || packed->bits > 32 || packedSize(packed) > size) return;
+    if (packed->bits == 0) {
+        for (int j = 0; j < packed->nb_rec; j++) out->T[j].key = packed->base;
+    } else {
+        if (unpackKernel == NULL) setProbeKernel(PROBE_AUTO);
+        unpackKernel(packed, out);
+    }
+    out->nb_rec = packed->nb_rec;
+}
+
+
+//--- Hash index sidecar ---//
+
+static void indexName(char *dst, size_t size, const char *filename)
+{
+    formatName(dst, size, "%s.idx", filename);
+}
+
+static int indexHash(int key, int nbSlots)
+{
+    return (int)(((unsigned)key * 2654435761u) & (unsigned)(nbSlots - 1));
+}
+
+static long entryPos(int s)
+{
+    return 3 * sizeof(int) + (long)s * sizeof(IndexEntry);
+}
+
+static void readEntry(HashIndex *idx, int s, IndexEntry *e)
+{
+    fseek(idx->f, entryPos(s), 0);
+    fread(e, sizeof(IndexEntry), 1, idx->f);
+}
+
+static void writeEntry(HashIndex *idx, int s, IndexEntry *e)
+{
+    fseek(idx->f, entryPos(s), 0);
+    fwrite(e, sizeof(IndexEntry), 1, idx->f);
+}
+
+static int openIndex(HashIndex *idx, const char *filename)
+{
+    char name[PATH_MAX];
+    indexName(name, sizeof(name), filename);
+    idx->f = fopen(name, "rb+");
+    if (idx->f == NULL) return 0;
+    fread(&idx->nbSlots, sizeof(int), 1, idx->f);
+    fread(&idx->nbEntries, sizeof(int), 1, idx->f);
+    fread(&idx->nbUsed, sizeof(int), 1, idx->f);
+    return 1;
+}
+
+static void closeIndex(HashIndex *idx)
+{
+    rewind(idx->f);
+    fwrite(&idx->nbSlots, sizeof(int), 1, idx->f);
+    fwrite(&idx->nbEntries, sizeof(int), 1, idx->f);
+    fwrite(&idx->nbUsed, sizeof(int), 1, idx->f);
+    fclose(idx->f);
+    idx->f = NULL;
+}
+
+//--- Index of an open file, opened on first use and kept with the handle; NULL if the file has none ---//
+static HashIndex *indexOf(TnOF *file)
+{
+    if (!file->indexLoaded) {
+        file->indexLoaded = 1;
+        if (!openIndex(&file->index, fileNameOf(file->stats))) file->index.f = NULL;
+    }
+    return file->index.f != NULL ? &file->index : NULL;
+}
+
+//--- The index of an open file is removed: the handle forgets it ---//
+static void forgetIndex(TnOF *file)
+{
+    if (file->index.f != NULL) fclose(file->index.f);
+    file->index.f = NULL;
+    file->indexLoaded = 1;
+}
+
+//--- Insert into an in-memory table (used to build and to grow the index) ---//
+static void tablePut(IndexEntry *table, int nbSlots, int key, int block, int slot)
+{
+    int s = indexHash(key, nbSlots);
+    while (table[s].state == INDEX_USED) s = (s + 1) & (nbSlots - 1);
+    table[s].state = INDEX_USED;
+    table[s].key = key;
+    table[s].block = block;
+    table[s].slot = slot;
+}
+
+//--- Rewrite the whole index from an in-memory table ---//
+static void writeTable(HashIndex *idx, IndexEntry *table, int nbSlots, int nbEntries)
+{
+    idx->nbSlots = nbSlots;
+    idx->nbEntries = nbEntries;
+    idx->nbUsed = nbEntries;
+    fseek(idx->f, entryPos(0), 0);
+    fwrite(table, sizeof(IndexEntry), nbSlots, idx->f);
+}
+
+//--- Double the table (or just drop the deleted entries) once it is 70% used ---//
+static void growIndex(HashIndex *idx)
+{
+    IndexEntry *old = malloc(idx->nbSlots * sizeof(IndexEntry));
+    fseek(idx->f, entryPos(0), 0);
+    fread(old, sizeof(IndexEntry), idx->nbSlots, idx->f);
+
+    int nbSlots = idx->nbSlots;
+    while ((idx->nbEntries + 1) * 10 > nbSlots * 5) nbSlots *= 2;
+    IndexEntry *table = calloc(nbSlots, sizeof(IndexEntry));
+    for (int s = 0; s < idx->nbSlots; s++) {
+        if (old[s].state == INDEX_USED) tablePut(table, nbSlots, old[s].key, old[s].block, old[s].slot);
+    }
+    writeTable(idx, table, nbSlots, idx->nbEntries);
+    free(old);
+    free(table);
+}
+
+static void indexAdd(HashIndex *idx, int key, int block, int slot)
+{
+    if ((idx->nbUsed + 1) * 10 > idx->nbSlots * 7) growIndex(idx);
+
+    IndexEntry e;
+    int s = indexHash(key, idx->nbSlots);
+    readEntry(idx, s, &e);
+    while (e.state == INDEX_USED) {
+        s = (s + 1) & (idx->nbSlots - 1);
+        readEntry(idx, s, &e);
+    }
+    if (e.state == INDEX_EMPTY) idx->nbUsed++; // a deleted entry is reused as is
+    e.state = INDEX_USED;
+    e.key = key;
+    e.block = block;
+    e.slot = slot;
+    writeEntry(idx, s, &e);
+    idx->nbEntries++;
+}
+
+//--- Slot of the entry of (key, block, slot), -1 if absent ---//
+static int indexFindAt(HashIndex *idx, int key, int block, int slot)
+{
+    IndexEntry e;
+    int s = indexHash(key, idx->nbSlots);
+    for (int probes = 0; probes < idx->nbSlots; probes++) {
+        readEntry(idx, s, &e);
+        if (e.state == INDEX_EMPTY) return -1;
+        if (e.state == INDEX_USED && e.key == key && e.block == block && e.slot == slot) return s;
+        s = (s + 1) & (idx->nbSlots - 1);
+    }
+    return -1;
+}
+
+static void indexRemove(HashIndex *idx, int key, int block, int slot)
+{
+    IndexEntry e;
+    int s = indexFindAt(idx, key, block, slot);
+    if (s < 0) return;
+    e.state = INDEX_DELETED;
+    e.key = key;
+    e.block = block;
+    e.slot = slot;
+    writeEntry(idx, s, &e);
+    idx->nbEntries--;
+}
+
+static void indexMove(HashIndex *idx, int key, int oldBlock, int oldSlot, int block, int slot)
+{
+    IndexEntry e;
+    int s = indexFindAt(idx, key, oldBlock, oldSlot);
+    if (s < 0) return;
+    e.state = INDEX_USED;
+    e.key = key;
+    e.block = block;
+    e.slot = slot;
+    writeEntry(idx, s, &e);
+}
+
+//--- Keep the index in sync after a physical deletion of (key, i, j) ---//
+// The last record of the file, at (lastBlock, lastSlot), was moved into (i, j).
+static void indexDelete(TnOF *file, int key, int i, int j, int movedKey, int lastBlock, int lastSlot)
+{
+    HashIndex *idx = indexOf(file);
+    if (idx == NULL) return;
+    indexRemove(idx, key, i, j);
+    if (lastBlock != i || lastSlot != j) indexMove(idx, movedKey, lastBlock, lastSlot, i, j);
+}
+
+static void indexInsert(TnOF *file, int key, int i, int j)
+{
+    HashIndex *idx = indexOf(file);
+    if (idx != NULL) indexAdd(idx, key, i, j);
+}
+
+void buildIndex(const char *filename)
+{
+    TnOF file;
+    Tblock buffer;
+    open(&file, filename, 'o');
+    if (file.f == NULL) {
+        printf("Error: Could not open file '%s'\n", filename);
+        return;
+    }
+    if (file.header.sorted) { // positions move on every insert and delete
+        printf("%s is sorted and searched by binary search: no index kept\n", filename);
+        close(file);
+        return;
+    }
+
+    int nbSlots = 64;
+    while (nbSlots < 2 * getHeader(file, 2)) nbSlots *= 2; // at most 50% used after the build
+    IndexEntry *table = calloc(nbSlots, sizeof(IndexEntry));
+    int nbEntries = 0;
+    for (int i = 1; i <= getHeader(file, 1); i++) {
+        const Tblock *block = peekBlock(file, i, &buffer);
+        for (int j = 0; j < block->nb_rec; j++) {
+            if (block->T[j].key == TOMBSTONE_KEY) continue;
+            tablePut(table, nbSlots, block->T[j].key, i, j);
+            nbEntries++;
+        }
+    }
+    close(file);
+
+    char name[PATH_MAX];
+    indexName(name, sizeof(name), filename);
+    HashIndex idx;
+    idx.f = fopen(name, "wb+");
+    writeTable(&idx, table, nbSlots, nbEntries);
+    closeIndex(&idx);
+    free(table);
+    printf("Index %s built: %d keys in %d slots\n", name, nbEntries, nbSlots);
+}
+
+void dropIndex(const char *filename)
+{
+    char name[PATH_MAX];
+    indexName(name, sizeof(name), filename);
+    remove(name);
+}
+
+//--- Index lookup on an open file: one block read to check the entry or find the insertion position ---//
+static int searchIndexOpen(TnOF *file, const int key, int *found, int *i, int *j)
+{
+    HashIndex *idx = indexOf(file);
+    if (idx == NULL) return 0;
+
+    IndexEntry e;
+    int s = indexHash(key, idx->nbSlots);
+    *found = 0;
+    for (int probes = 0; probes < idx->nbSlots; probes++) {
+        readEntry(idx, s, &e);
+        if (e.state == INDEX_EMPTY) break;
+        if (e.state == INDEX_USED && e.key == key) {
+            *found = 1;
+            break;
+        }
+        s = (s + 1) & (idx->nbSlots - 1);
+    }
+
+    Tblock buffer;
+    int nbBlocks = getHeader(*file, 1);
+    int usable = 1;
+    if (*found) {
+        const Tblock *block = peekBlock(*file, e.block, &buffer);
+        usable = (block != NULL) && (e.slot < block->nb_rec) && (block->T[e.slot].key == key);
+        *i = e.block;
+        *j = e.slot;
+    } else if (nbBlocks == 0) {
+        *i = 0;
+        *j = 0;
+    } else {
+        const Tblock *block = peekBlock(*file, nbBlocks, &buffer);
+        *i = nbBlocks;
+        *j = block->nb_rec;
+        if (*j >= getHeader(*file, 3)) {
+            *i = *i + 1;
+            *j = 0;
+        }
+    }
+    return usable; // a stale entry makes the caller fall back to a scan
+}
+
+int searchIndex(const int key, const char *filename, int *found, int *i, int *j)
+{
+    TnOF file;
+    open(&file, filename, 'o');
+    if (file.f == NULL) return 0;
+    int usable = searchIndexOpen(&file, key, found, i, j);
+    close(file);
+    return usable;
+}
+
+
+//--- Bloom filter lookups: a file filter miss answers without reading any data block ---//
+
+static void rebuildBloom(TnOF *file)
+{
+    Tblock buffer;
+    BloomFilter *old = file->bloom;
+    file->bloom = newBloom(file->header.nb_rec, file->header.blockCapacity, file->header.nb_block, old->blockBits > 0);
+    freeBloom(old);
+    for (int i = 1; i <= file->header.nb_block; i++) bloomAddBlock(file, peekBlock(*file, i, &buffer), i);
+}
+
+//--- Filter of an open file for a lookup, rebuilt first if stale, overfull or worn by deletions ---//
+static BloomFilter *bloomLookup(TnOF *file)
+{
+    BloomFilter *bloom = bloomOf(file);
+    if (bloom == NULL) return NULL;
+    if (bloom->stale || bloom->deletes > bloom->keys / 4 || file->header.nb_rec > 2 * bloom->keys) rebuildBloom(file);
+    return file->bloom;
+}
+
+static int bloomBlockMayContain(TnOF *file, int key, int block)
+{
+    BloomFilter *bloom = file->bloom;
+    if (bloom->blockBits == 0 || block > bloom->nbBlocks) return 1;
+    return bloomTest(bloom, &bloom->blockFilters, (long)(block - 1) * bloom->blockBits / 8, bloom->blockBits,
+                     bloomHash(key), BLOOM_BLOCK_HASHES);
+}
+
+//--- Insertion position of a missing key from the header: every block but the last is full ---//
+static void tailPosition(TnOF *file, int *i, int *j)
+{
+    int nbBlocks = getHeader(*file, 1);
+    int blockCapacity = getHeader(*file, 3);
+    *i = nbBlocks;
+    *j = 0;
+    if (nbBlocks == 0) return;
+    *j = getHeader(*file, 2) - (nbBlocks - 1) * blockCapacity;
+    if (*j < 1 || *j > blockCapacity) { // not the usual shape: ask the last block
+        Tblock buffer;
+        *j = peekBlock(*file, nbBlocks, &buffer)->nb_rec;
+    }
+    if (*j >= blockCapacity) {
+        *i = *i + 1;
+        *j = 0;
+    }
+}
+
+void buildBloom(const char *filename, int mode)
+{
+    TnOF file;
+    open(&file, filename, 'o');
+    if (file.f == NULL) {
+        printf("Error: Could not open file '%s'\n", filename);
+        return;
+    }
+    if (file.header.sorted) { // positions move on every insert and delete
+        printf("%s is sorted and searched by binary search: no Bloom filter kept\n", filename);
+        close(file);
+        return;
+    }
+    freeBloom(bloomOf(&file));
+    file.bloom = newBloom(file.header.nb_rec, file.header.blockCapacity, file.header.nb_block, mode == BLOOM_BLOCK);
+    file.bloom->stale = 1; // filled from the blocks by the rebuild
+    bloomLookup(&file);
+    long bits = file.bloom->bits + (long)file.bloom->nbBlocks * file.bloom->blockBits;
+    close(file);
+    printf("Bloom filter of %s built: %d keys, %ld bytes%s\n", filename, getHeader(file, 2), bits / 8,
+           mode == BLOOM_BLOCK ? " (with block filters)" : "");
+}
+
+
+void initialLoad(TnOF *file) //--- Create a new file and initialize it ---//
+{
+    char name[20];
+    printf("Enter the name of the file to create: ");
+    scanf("%19s", name);
+    getchar();
+    open(file, name, 'n');
+    if (blockEncoding == ENCODING_PACKED) startPacked(file);
+
+    // Display max records info and get loading factor
+    printf("Maximum records per block: %d\n", MAX_RECORDS);
+    printf("Enter loading factor (0.0 to 1.0): ");
+    float loadingFactor;
+    scanf("%f", &loadingFactor);
+    getchar();
+    
+    if (loadingFactor <= 0.0 || loadingFactor > 1.0) {
+        printf("Invalid loading factor! Using default 0.8\n");
+        loadingFactor = 0.8;
+    }
+
+    // Calculate effective block capacity based on loading factor
+    int blockCapacity = (int)(MAX_RECORDS * loadingFactor);
+    if (blockCapacity < 1) blockCapacity = 1; // At least 1 record per block
+    file->header.blockCapacity = blockCapacity; // Store in header
+    printf("Effective records per block: %d\n", blockCapacity);
+
+    int numBlocks, i = 0, j = 0;
+    printf("Enter the number of blocks to create: ");
+    do
+    {
+        scanf("%d", &numBlocks);
+        getchar();
+    } while(numBlocks < 1);
+
+    int numRecords = numBlocks * blockCapacity; // Total records = blocks × capacity
+
+    Tblock buf;
+    buf.nb_rec = 0;
+    printf("\nProceed with data entry (%d records total):\n", numRecords);
+    while(i < numRecords)
+    {
+        if((j + 1) <= blockCapacity) //--- Use loading factor capacity instead of MAX_RECORDS ---//
+        {
+            printf("\nKey %d = ", i + 1);
+            scanf("%d", &(buf.T[j].key));
+            getchar();
+            i++;
+            j++;
+        }
+        else
+        {
+            buf.nb_rec = j;
+            appendBlock(file, buf);
+            j = 0;
+        }
+    }
+    if(j != 0)
+    {
+        buf.nb_rec = j;
+        appendBlock(file, buf);
+    }
+    file->header.nb_rec = numRecords;
+    close(*file);
+}
+
+
+//--- Read the next keys of a text stream: integers separated by anything else ---//
+typedef struct TextReader
+{
+    FILE *in;
+    char buf[1 << 16];
+    int len;
+    int pos;
+}TextReader;
+
+static int nextTextKey(TextReader *reader, int *key)
+{
+    int c, inNumber = 0, negative = 0;
+    long value = 0;
+    while (1) {
+        if (reader->pos == reader->len) {
+            reader->len = fread(reader->buf, 1, sizeof(reader->buf), reader->in);
+            reader->pos = 0;
+            if (reader->len <= 0) {
+                reader->len = 0;
+                break;
+            }
+        }
+        c = reader->buf[reader->pos];
+        if (c >= '0' && c <= '9') {
+            value = value * 10 + (c - '0');
+            inNumber = 1;
+        } else if (inNumber) {
+            break;
+        } else {
+            negative = (c == '-');
+        }
+        reader->pos++;
+    }
+    if (!inNumber) return 0;
+    *key = (int)(negative ? -value : value);
+    return 1;
+}
+
+//--- Number of keys of a key file, estimated from its size (0 for stdin) ---//
+static long sourceKeys(FILE *in, int format)
+{
+    if (in == stdin || fseek(in, 0, SEEK_END) != 0) return 0;
+    long size = ftell(in);
+    rewind(in);
+    return format == LOAD_BINARY ? size / (long)sizeof(int) : size / 7; // text: about 6 digits and a separator
+}
+
+long bulkLoadTnOF(const char *filename, const char *source, int format, float loadingFactor)
+{
+    FILE *in = (strcmp(source, "-") == 0) ? stdin : fopen(source, format == LOAD_BINARY ? "rb" : "r");
+    if (in == NULL) {
+        printf("Error: Could not open key file '%s'\n", source);
+        return -1;
+    }
+    if (loadingFactor <= 0.0 || loadingFactor > 1.0) loadingFactor = 0.8;
+    int blockCapacity = (int)(MAX_RECORDS * loadingFactor);
+    if (blockCapacity < 1) blockCapacity = 1;
+
+    TnOF file;
+    open(&file, filename, 'n');
+    if (file.f == NULL) {
+        printf("Error: Could not create file '%s'\n", filename);
+        if (in != stdin) fclose(in);
+        return -1;
+    }
+    file.header.blockCapacity = blockCapacity;
+    if (blockEncoding == ENCODING_PACKED) startPacked(&file);
+    attachBloom(&file, sourceKeys(in, format)); // a poor estimate only costs a rebuild on the first lookup
+
+    // Blocks are filled LOAD_BATCH at a time and appended with a single write, in one sequential stream
+    Tblock *batch = malloc(LOAD_BATCH * sizeof(Tblock));
+    int *raw = malloc(blockCapacity * sizeof(int));
+    TextReader *reader = NULL;
+    if (format != LOAD_BINARY) {
+        reader = malloc(sizeof(TextReader));
+        reader->in = in;
+        reader->len = 0;
+        reader->pos = 0;
+    }
+    long total = 0, skipped = 0;
+    int b = 0, done = 0;
+    while (!done) {
+        int n = 0;
+        if (format == LOAD_BINARY) {
+            n = fread(raw, sizeof(int), blockCapacity, in);
+        } else {
+            while (n < blockCapacity && nextTextKey(reader, &raw[n])) n++;
+        }
+        if (n < blockCapacity) done = 1;
+        if (n == 0) break;
+
+        int kept = 0;
+        for (int j = 0; j < n; j++) {
+            if (raw[j] == TOMBSTONE_KEY) skipped++; // it marks deleted slots
+            else batch[b].T[kept++].key = raw[j];
+        }
+        if (kept == 0) continue;
+        batch[b].nb_rec = kept;
+        total += kept;
+        if (++b == LOAD_BATCH) {
+            appendBlocks(&file, batch, b);
+            b = 0;
+        }
+    }
+    if (b > 0) appendBlocks(&file, batch, b);
+
+    file.header.nb_rec = total;
+    close(file); // the only header write
+    if (in != stdin) fclose(in);
+    free(batch);
+    free(raw);
+    free(reader);
+    printf("Loaded %ld keys into %s: %d blocks of %d records", total, filename, file.header.nb_block, blockCapacity);
+    if (skipped > 0) printf(", %ld keys %d skipped", skipped, TOMBSTONE_KEY);
+    printf("\n");
+    return total;
+}
+
+
+//--- Block encodings: the live records are copied in order to "<file>.recode" in the other encoding, which replaces the file ---//
+
+static long storedBytes(const TnOF *file)
+{
+    int nbBlocks = file->header.nb_block;
+    if (file->directory != NULL) return file->directory[nbBlocks] + (nbBlocks + 1) * (long)sizeof(long);
+    return blockOffset(nbBlocks + 1);
+}
+
+static long recodeTnOF(const char *filename, int encoding)
+{
+    const char *label = encoding == ENCODING_PACKED ? "packed" : "unpacked";
+    TnOF source;
+    open(&source, filename, 'o');
+    if (source.f == NULL) {
+        printf("Error: Could not open file '%s'\n", filename);
+        return -1;
+    }
+    if (source.header.encoding == encoding) {
+        long bytes = storedBytes(&source);
+        close(source);
+        printf("%s is already %s\n", filename, label);
+        return bytes;
+    }
+    char *name = malloc(strlen(filename) + 8);
+    sprintf(name, "%s.recode", filename);
+    TnOF target;
+    open(&target, name, 'n');
+    if (target.f == NULL) {
+        printf("Error: Could not create file '%s'\n", name);
+        close(source);
+        free(name);
+        return -1;
+    }
+    int blockCapacity = source.header.blockCapacity;
+    target.header.blockCapacity = blockCapacity;
+    target.header.sorted = source.header.sorted; // blocks are refilled in order: every block but the last stays full
+    target.header.subFragments = source.header.subFragments;
+    if (encoding == ENCODING_PACKED) startPacked(&target);
+
+    // Blocks of blockCapacity live records, LOAD_BATCH appended per write
+    Tblock *batch = malloc(LOAD_BATCH * sizeof(Tblock));
+    Tblock buffer;
+    int b = 0;
+    long records = 0;
+    batch[0].nb_rec = 0;
+    for (int i = 1; i <= source.header.nb_block; i++) {
+        const Tblock *block = peekBlock(source, i, &buffer);
+        for (int j = 0; j < block->nb_rec; j++) {
+            if (block->T[j].key == TOMBSTONE_KEY) continue;
+            batch[b].T[batch[b].nb_rec++] = block->T[j];
+            records++;
+            if (batch[b].nb_rec == blockCapacity) {
+                if (++b == LOAD_BATCH) {
+                    appendBlocks(&target, batch, b);
+                    b = 0;
+                }
+                batch[b].nb_rec = 0;
+            }
+        }
+    }
+    if (batch[b].nb_rec > 0) b++;
+    if (b > 0) appendBlocks(&target, batch, b);
+    target.header.nb_rec = records;
+
+    long before = storedBytes(&source), after = storedBytes(&target);
+    int nbBlocks = target.header.nb_block;
+    close(source);
+    close(target);
+    poolDropFrom(source.stats, 1); // frames of the file being replaced
+    if (rename(name, filename) != 0) {
+        printf("Error: Could not replace '%s' with '%s'\n", filename, name);
+        remove(name);
+        free(batch);
+        free(name);
+        return -1;
+    }
+    dropIndex(filename); // positions moved with the tombstones left out
+    dropBloom(filename);
+    printf("%s %s: %ld records in %d blocks, %ld bytes instead of %ld\n", filename, label, records, nbBlocks, after, before);
+    free(batch);
+    free(name);
+    return after;
+}
+
+long packTnOF(const char *filename)
+{
+    return recodeTnOF(filename, ENCODING_PACKED);
+}
+
+long unpackTnOF(const char *filename)
+{
+    return recodeTnOF(filename, ENCODING_RAW);
+}
+
+
+//--- Sorted files (TOF layout): keys ascending across blocks, every block but the last holds blockCapacity records ---//
+// Positions move on every insert and delete, so sorted files keep no hash index and no Bloom filter (see sortTnOF)
+
+static int compareRecords(const void *a, const void *b)
+{
+    int x = ((const Record *)a)->key, y = ((const Record *)b)->key;
+    return (x > y) - (x < y);
+}
+
+//--- Binary search over the blocks, then inside one: first position with a key >= key, log2(nb_block) + 1 block reads ---//
+static void sortedSearch(TnOF *file, const int key, int *found, int *i, int *j)
+{
+    Tblock buffer;
+    const Tblock *block;
+    int nbBlocks = getHeader(*file, 1);
+    *found = 0, *i = 1, *j = 0;
+    if (nbBlocks == 0) return;
+
+    int lo = 1, hi = nbBlocks;
+    while (lo < hi) { // first block whose last key is >= key
+        int mid = lo + (hi - lo) / 2;
+        block = peekBlock(*file, mid, &buffer);
+        if (block->nb_rec > 0 && block->T[block->nb_rec - 1].key < key) lo = mid + 1;
+        else hi = mid;
+    }
+    block = peekBlock(*file, lo, &buffer);
+    int left = 0, right = block->nb_rec;
+    while (left < right) {
+        int mid = (left + right) / 2;
+        if (block->T[mid].key < key) left = mid + 1;
+        else right = mid;
+    }
+    *i = lo;
+    *j = left;
+    *found = (left < block->nb_rec) && (block->T[left].key == key);
+    if (*j >= getHeader(*file, 3)) { // greater than every key and the last block is full
+        *i = *i + 1;
+        *j = 0;
+    }
+}
+
+//--- Insert at (i, j): every later record moves one slot right, the last record of a full block into the next one ---//
+static void sortedInsertAt(TnOF *file, int i, int j, Record record)
+{
+    Tblock buffer;
+    int blockCapacity = getHeader(*file, 3);
+    Record carry = record;
+    for (int moving = 1; moving; i++, j = 0) {
+        if (i > getHeader(*file, 1)) allocateBlock(file);
+        readBlock(*file, i, &buffer);
+        if (buffer.nb_rec < blockCapacity) {
+            memmove(&buffer.T[j + 1], &buffer.T[j], (buffer.nb_rec - j) * sizeof(Record));
+            buffer.T[j] = carry;
+            buffer.nb_rec++;
+            moving = 0;
+        } else {
+            Record last = buffer.T[blockCapacity - 1];
+            memmove(&buffer.T[j + 1], &buffer.T[j], (blockCapacity - 1 - j) * sizeof(Record));
+            buffer.T[j] = carry;
+            carry = last;
+        }
+        writeBlock(*file, i, buffer);
+    }
+    file->header.nb_rec++;
+}
+
+//--- Delete (i, j): every later record moves one slot left, the first record of each next block into the one before ---//
+static void sortedDeleteAt(TnOF *file, int i, int j)
+{
+    Tblock buffer, next;
+    int nbBlocks = getHeader(*file, 1);
+    readBlock(*file, i, &buffer);
+    buffer.nb_rec--;
+    memmove(&buffer.T[j], &buffer.T[j + 1], (buffer.nb_rec - j) * sizeof(Record));
+    for (; i < nbBlocks; i++) {
+        readBlock(*file, i + 1, &next);
+        buffer.T[buffer.nb_rec++] = next.T[0];
+        writeBlock(*file, i, buffer);
+        next.nb_rec--;
+        memmove(&next.T[0], &next.T[1], next.nb_rec * sizeof(Record));
+        buffer = next;
+    }
+    if (buffer.nb_rec == 0) file->header.nb_block--; //--- If the last block becomes empty ---//
+    else writeBlock(*file, i, buffer);
+    file->header.nb_rec--;
+}
+
+//--- Record p of a sorted file (0-based), reading its block into buf only when it is not there yet ---//
+static Record sortedRecord(TnOF *file, long p, Tblock *buf, int *loaded)
+{
+    int blockCapacity = getHeader(*file, 3);
+    int block = (int)(p / blockCapacity) + 1;
+    if (*loaded != block) {
+        readBlock(*file, block, buf);
+        *loaded = block;
+    }
+    return buf->T[p % blockCapacity];
+}
+
+//--- Merge n records into a sorted file in place, from the end: a record only ever moves towards the end ---//
+static void sortedInsertBatch(TnOF *file, const Record *recs, size_t n)
+{
+    if (n == 0) return;
+    Record *batch = malloc(n * sizeof(Record));
+    memcpy(batch, recs, n * sizeof(Record));
+    qsort(batch, n, sizeof(Record), compareRecords);
+
+    int blockCapacity = getHeader(*file, 3);
+    long in = getHeader(*file, 2) - 1;      // next record of the file, from its end
+    long b = (long)n - 1;                   // next record of the batch
+    long out = in + (long)n;                // where the larger of the two goes
+    int nbBlocks = (int)(out / blockCapacity) + 1;
+    while (getHeader(*file, 1) < nbBlocks) allocateBlock(file);
+
+    Tblock inBuf, outBuf;
+    int loaded = 0;
+    int outBlock = nbBlocks;
+    outBuf.nb_rec = (int)(out % blockCapacity) + 1;
+    while (b >= 0) {
+        Record r;
+        if (in >= 0 && sortedRecord(file, in, &inBuf, &loaded).key > batch[b].key) r = sortedRecord(file, in--, &inBuf, &loaded);
+        else r = batch[b--];
+        outBuf.T[out-- % blockCapacity] = r;
+        if (out < 0 || (out + 1) % blockCapacity == 0) { // outBlock is complete, the records still to read are all before it
+            writeBlock(*file, outBlock--, outBuf);
+            outBuf.nb_rec = blockCapacity;
+        }
+    }
+    if ((out + 1) % blockCapacity != 0) { // the batch ran out inside outBlock: its first records are still in place
+        while (out >= 0 && out % blockCapacity != blockCapacity - 1) outBuf.T[out-- % blockCapacity] = sortedRecord(file, in--, &inBuf, &loaded);
+        writeBlock(*file, outBlock, outBuf);
+    }
+    file->header.nb_rec += n;
+    free(batch);
+}
+
+void searchOpenTnOF(TnOF *file, const int key, int *found, int *i, int *j)
+{
+    if (key == TOMBSTONE_KEY) { // the deleted slots are not records
+        *found = 0;
+        tailPosition(file, i, j);
+        return;
+    }
+    if (file->header.sorted) {
+        sortedSearch(file, key, found, i, j);
+        return;
+    }
+    BloomFilter *bloom = bloomLookup(file);
+    if (bloom != NULL && !bloomTest(bloom, &bloom->filter, 0, bloom->bits, bloomHash(key), BLOOM_HASHES)) {
+        *found = 0;
+        tailPosition(file, i, j); // definitely absent: no data block read
+        return;
+    }
+    if (searchIndexOpen(file, key, found, i, j)) return; // O(1) block reads when the file is indexed
+
+    int stop = 0;
+    Tblock buffer;
+    const Tblock *block;
+    int nbBlocks = getHeader(*file, 1);
+    *i=0, *j=0,*found=0;
+    while((*i<nbBlocks) && (!*found) && (!stop))
+    {
+        *i=*i+1;
+        if (bloom != NULL && *i < nbBlocks && !bloomBlockMayContain(file, key, *i)) continue; // the last block gives j
+
+        block = peekBlock(*file, *i, &buffer);
+        *j = probeBlock(block, key);
+        if(*j >= 0){
+            *found = 1;
+            stop=1;
+        }
+        else *j = block->nb_rec;
+    }
+    //in case the the record should be in a new bloc
+    int blockCapacity = getHeader(*file, 3);
+    if(*j >= blockCapacity){
+        *i=*i+1;
+        *j=0;
+    } 
+}
+
+void searchTnOF(const int key, const char *filename,int *found, int *i, int *j)
+{
+    TnOF file;
+    open(&file, filename, 'o');
+    searchOpenTnOF(&file, key, found, i, j);
+    close (file);
+}
+
+
+int insertOpenTnOF(TnOF *file, Record record)
+{
+    int i, j;
+    Tblock buffer;
+
+    if (record.key == TOMBSTONE_KEY) {
+        printf("Error: Key %d marks deleted slots and cannot be inserted\n", TOMBSTONE_KEY);
+        return 0;
+    }
+    if (refusePacked(file)) return 0;
+
+    if (file->header.sorted) { // ordered insertion after the key's lower bound
+        int found;
+        sortedSearch(file, record.key, &found, &i, &j);
+        sortedInsertAt(file, i, j, record);
+        return 1;
+    }
+
+    // Find insertion position (don't check for duplicates)
+    int nbBlocks = getHeader(*file, 1);
+    int blockCapacity = getHeader(*file, 3);
+    
+    if (nbBlocks == 0) {
+        // Empty file - insert at block 1, position 0
+        i = 1;
+        j = 0;
+    } else {
+        // Read last block to find insertion position
+        readBlock(*file, nbBlocks, &buffer);
+        if (buffer.nb_rec < blockCapacity) {
+            // Space in last block
+            i = nbBlocks;
+            j = buffer.nb_rec;
+        } else {
+            // Need new block
+            i = nbBlocks + 1;
+            j = 0;
+        }
+    }
+
+    if (i > nbBlocks) allocateBlock(file); // Allocate new block if needed
+
+    readBlock(*file, i, &buffer);
+    buffer.T[j] = record;
+    buffer.nb_rec++;
+    writeBlock(*file, i, buffer);
+    file->header.nb_rec++;
+
+    bloomAdd(file, record.key, i);
+    indexInsert(file, record.key, i, j);
+    return 1;
+}
+
+void inserTnOF(const char *filename, Record record) //--- Procedure to insert a record ---//
+{
+    TnOF file;
+    open(&file, filename, 'o');
+    int inserted = insertOpenTnOF(&file, record);
+    close(file);
+    if (inserted) printf("Your record has been added successfully\n");
+}
+
+
+static void insertBatchRecords(const char *filename, const Record *recs, size_t n)
+{
+    TnOF file;
+    Tblock buffer;
+    open(&file, filename, 'o');
+    if (file.f == NULL) {
+        printf("Error: Could not open file '%s'\n", filename);
+        return;
+    }
+    if (refusePacked(&file)) {
+        close(file);
+        return;
+    }
+    int nbBlocks = getHeader(file, 1);
+    int blockCapacity = getHeader(file, 3);
+    if (file.header.sorted) {
+        sortedInsertBatch(&file, recs, n);
+        close(file);
+        return;
+    }
+    HashIndex *idx = indexOf(&file);
+    size_t k = 0;
+
+    // 1: Fill the tail block, written once
+    if (nbBlocks > 0) {
+        readBlock(file, nbBlocks, &buffer);
+        if (buffer.nb_rec < blockCapacity) {
+            while (k < n && buffer.nb_rec < blockCapacity) {
+                if (idx != NULL) indexAdd(idx, recs[k].key, nbBlocks, buffer.nb_rec);
+                bloomAdd(&file, recs[k].key, nbBlocks);
+                buffer.T[buffer.nb_rec++] = recs[k++];
+            }
+            writeBlock(file, nbBlocks, buffer);
+        }
+    }
+
+    // 2: Build whole new blocks in memory and append each one with a single write
+    while (k < n) {
+        buffer.nb_rec = 0;
+        while (k < n && buffer.nb_rec < blockCapacity) {
+            if (idx != NULL) indexAdd(idx, recs[k].key, file.header.nb_block + 1, buffer.nb_rec);
+            buffer.T[buffer.nb_rec++] = recs[k++];
+        }
+        appendBlock(&file, buffer);
+    }
+
+    file.header.nb_rec += n;
+    close(file); // header written once for the whole batch
+}
+
+void insertBatchTnOF(const char *filename, const Record *recs, size_t n) //--- Insert n records at once ---//
+{
+    size_t skipped = 0;
+    for (size_t k = 0; k < n; k++) {
+        if (recs[k].key == TOMBSTONE_KEY) skipped++;
+    }
+    if (skipped == 0) {
+        insertBatchRecords(filename, recs, n);
+        return;
+    }
+    // TOMBSTONE_KEY marks deleted slots: those records are left out
+    Record *kept = malloc((n - skipped + 1) * sizeof(Record));
+    size_t count = 0;
+    for (size_t k = 0; k < n; k++) {
+        if (recs[k].key != TOMBSTONE_KEY) kept[count++] = recs[k];
+    }
+    printf("%zu records with key %d skipped\n", skipped, TOMBSTONE_KEY);
+    if (count > 0) insertBatchRecords(filename, kept, count);
+    free(kept);
+}
+
+int deleteOpenTnOF(TnOF *file, int key, int *i, int *j)
+{
+    int found;
+    searchOpenTnOF(file, key, &found, i, j);
+    if (!found || refusePacked(file)) return 0;
+    if (file->header.sorted) {
+        sortedDeleteAt(file, *i, *j);
+        return 1;
+    }
+
+    Tblock buffer;
+    Record temp;
+    int lastBlock = getHeader(*file,1);
+    readBlock(*file, lastBlock, &buffer);
+    temp = buffer.T[buffer.nb_rec-1]; //get the last record
+    buffer.nb_rec--;
+    int lastSlot = buffer.nb_rec;
+    file->header.nb_rec = file->header.nb_rec - 1;
+
+    if (buffer.nb_rec == 0) //--- If a block becomes empty ---//
+    {
+        file->header.nb_block = file->header.nb_block - 1;
+    }else{
+        writeBlock(*file, getHeader(*file,1), buffer);
+    }
+
+    readBlock(*file, *i, &buffer);
+    buffer.T[*j]=temp; //replace the record you want to delete with the last record
+    writeBlock(*file, *i, buffer);
+
+    BloomFilter *bloom = bloomOf(file);
+    if (bloom != NULL) { // the deleted key stays behind as a false positive until the next rebuild
+        bloomAdd(file, temp.key, *i);
+        bloom->deletes++;
+        bloom->dirty = 1;
+    }
+    indexDelete(file, key, *i, *j, temp.key, lastBlock, lastSlot);
+    return 1;
+}
+
+void deleteTnOFphy(const char *filename, int key) //--- Physical deletion procedure ---//
+{
+    int i, j;
+    TnOF file;
+    open(&file, filename, 'o');
+    int found = deleteOpenTnOF(&file, key, &i, &j);
+    close(file);
+    printf("%d %d\n",i,j);
+
+    if (found) printf("Your record has been deleted successfully\n");
+    else printf("Your record doesn't exist in the file\n");
+}
+
+
+//--- Tombstone deletes: the slot of a deleted record keeps TOMBSTONE_KEY until a compaction packs the file ---//
+
+static int tombstoneDeletes = 0;
+
+void setTombstoneDeletes(int on)
+{
+    tombstoneDeletes = on ? 1 : 0;
+}
+
+int getTombstoneDeletes()
+{
+    return tombstoneDeletes;
+}
+
+//--- Keep the index in sync after a logical deletion of (key, i, j): nothing moved ---//
+static void indexTombstone(TnOF *file, int key, int i, int j)
+{
+    HashIndex *idx = indexOf(file);
+    if (idx != NULL) indexRemove(idx, key, i, j);
+}
+
+int deleteLogicalOpen(TnOF *file, int key, int *i, int *j)
+{
+    if (file->header.sorted) return deleteOpenTnOF(file, key, i, j); // a tombstone would break the order
+    int found;
+    searchOpenTnOF(file, key, &found, i, j);
+    if (!found || refusePacked(file)) return 0;
+
+    Tblock buffer;
+    readBlock(*file, *i, &buffer); // a pool hit: the search just read it
+    buffer.T[*j].key = TOMBSTONE_KEY;
+    writeBlock(*file, *i, buffer); // the only write, the header goes with close()
+    file->header.tombstones++;
+
+    BloomFilter *bloom = bloomOf(file);
+    if (bloom != NULL) { // the deleted key stays behind as a false positive until the next rebuild
+        bloom->deletes++;
+        bloom->dirty = 1;
+    }
+    indexTombstone(file, key, *i, *j);
+    pthread_mutex_lock(&handlesLock);
+    entryOf(file->stats)->tombstoned = 1; // for the background compactor
+    pthread_mutex_unlock(&handlesLock);
+    return 1;
+}
+
+void deleteTnOFlog(const char *filename, int key) //--- Logical deletion procedure ---//
+{
+    int i, j;
+    TnOF file;
+    open(&file, filename, 'o');
+    if (file.f == NULL) {
+        printf("Error: Could not open file '%s'\n", filename);
+        return;
+    }
+    int found = deleteLogicalOpen(&file, key, &i, &j);
+    close(file);
+
+    if (found) printf("Your record has been deleted successfully (tombstone at block %d, position %d)\n", i, j);
+    else printf("Your record doesn't exist in the file\n");
+}
+
+//--- The live records are packed towards the front in order: blocks before the first tombstone are not rewritten ---//
+int compactOpenTnOF(TnOF *file)
+{
+    if (file->header.tombstones == 0 || file->header.sorted || file->directory != NULL) return 0; // packed: no tombstones
+    HashIndex *idx = indexOf(file);
+    int nbBlocks = getHeader(*file, 1);
+    int blockCapacity = getHeader(*file, 3);
+    int written = 0, reclaimed = 0, moved = 0;
+    Tblock in, out;
+    out.nb_rec = 0;
+    for (int i = 1; i <= nbBlocks; i++) {
+        readBlock(*file, i, &in);
+        for (int j = 0; j < in.nb_rec; j++) {
+            if (in.T[j].key == TOMBSTONE_KEY) {
+                reclaimed++;
+                continue;
+            }
+            if (written + 1 != i || out.nb_rec != j) { // never ahead of the block being read
+                if (idx != NULL) indexMove(idx, in.T[j].key, i, j, written + 1, out.nb_rec);
+                moved = 1;
+            }
+            out.T[out.nb_rec++] = in.T[j];
+            if (out.nb_rec == blockCapacity) {
+                written++;
+                if (reclaimed > 0 || moved) writeBlock(*file, written, out);
+                out.nb_rec = 0;
+            }
+        }
+    }
+    if (out.nb_rec > 0) writeBlock(*file, ++written, out);
+
+    // Drop the freed blocks from the header and from the file
+    file->header.nb_block = written;
+    file->header.nb_rec -= reclaimed;
+    file->header.tombstones = 0;
+    poolDropFrom(file->stats, written + 1); // a write-back would extend the file again
+    if (file->map == NULL) sysResize(file->f, blockOffset(written + 1)); // close() truncates mapped files
+    BloomFilter *bloom = bloomOf(file);
+    if (bloom != NULL && (reclaimed > 0 || moved)) { // records moved between blocks: rebuilt before the next lookup
+        bloom->stale = 1;
+        bloom->dirty = 1;
+    }
+    return reclaimed;
+}
+
+long compactTnOF(const char *filename)
+{
+    TnOF file;
+    open(&file, filename, 'o');
+    if (file.f == NULL) {
+        printf("Error: Could not open file '%s'\n", filename);
+        return -1;
+    }
+    int reclaimed = compactOpenTnOF(&file);
+    int nbBlocks = getHeader(file, 1);
+    close(file);
+    printf("%d tombstones reclaimed from %s, %d blocks left\n", reclaimed, filename, nbBlocks);
+    return reclaimed;
+}
+
+//--- Background compaction: every interval, the files given tombstones that nobody has open ---//
+
+static int compactThreshold = 0;    // percent of the slots of a file
+static int compactInterval = 0;     // ms
+static int compactorStop = 0;
+static pthread_cond_t compactorWake = PTHREAD_COND_INITIALIZER;
+
+static void compactIfWorn(const char *filename)
+{
+    TnOF file;
+    open(&file, filename, 'o');
+    if (file.f == NULL) return;
+    if (file.header.tombstones > 0 && (long)file.header.tombstones * 100 >= (long)compactThreshold * file.header.nb_rec) {
+        compactOpenTnOF(&file);
+    }
+    close(file);
+}
+
+static void *compactorLoop(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&handlesLock);
+    while (!compactorStop) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += compactInterval / 1000;
+        until.tv_nsec += (compactInterval % 1000) * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&compactorWake, &handlesLock, &until);
+
+        pthread_mutex_lock(&statsLock);
+        FileStats *entry = fileStats; // entries are only ever added in front of this one
+        pthread_mutex_unlock(&statsLock);
+        for (; entry != NULL && !compactorStop; entry = entry->next) {
+            if (!entry->tombstoned || entry->handles > 0) continue;
+            entry->tombstoned = 0;
+            entry->compacting = 1;
+            pthread_mutex_unlock(&handlesLock);
+            compactIfWorn(entry->name);
+            pthread_mutex_lock(&handlesLock);
+            entry->compacting = 0;
+            pthread_cond_broadcast(&handlesChanged);
+        }
+    }
+    pthread_mutex_unlock(&handlesLock);
+    return NULL;
+}
+
+static void compactorExit()
+{
+    stopCompactor();
+    flushBufferPool(); // what the last compaction left in the pool
+}
+
+int startCompactor(int thresholdPercent, int intervalMillis)
+{
+    static int exitHook = 0;
+    pthread_mutex_lock(&handlesLock);
+    if (compactorRunning) {
+        pthread_mutex_unlock(&handlesLock);
+        return 0;
+    }
+    compactThreshold = thresholdPercent > 0 ? thresholdPercent : 0;
+    compactInterval = intervalMillis > 0 ? intervalMillis : 1000;
+    compactorStop = 0;
+    pthread_create(&compactorThread, NULL, compactorLoop, NULL); // waits for handlesLock: compactorThread is set first
+    compactorRunning = 1;
+    pthread_mutex_unlock(&handlesLock);
+    if (!exitHook) {
+        atexit(compactorExit); // a compaction must not be cut short by the end of the program
+        exitHook = 1;
+    }
+    return 1;
+}
+
+void stopCompactor()
+{
+    pthread_mutex_lock(&handlesLock);
+    if (!compactorRunning) {
+        pthread_mutex_unlock(&handlesLock);
+        return;
+    }
+    compactorStop = 1;
+    pthread_cond_signal(&compactorWake);
+    pthread_mutex_unlock(&handlesLock);
+    pthread_join(compactorThread, NULL);
+    pthread_mutex_lock(&handlesLock);
+    compactorRunning = 0;
+    pthread_mutex_unlock(&handlesLock);
+}
+
+
+
+static int compareKeys(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+static int inKeySet(int key, const int *sortedKeys, size_t n)
+{
+    return bsearch(&key, sortedKeys, n, sizeof(int), compareKeys) != NULL;
+}
+
+//--- Sorted files: the survivors are packed towards the front in order, blocks before the first deletion are not rewritten ---//
+static int sortedDeleteBatch(TnOF *file, const int *sortedKeys, size_t n, int *removed)
+{
+    Tblock in, out;
+    int nbBlocks = getHeader(*file, 1);
+    int blockCapacity = getHeader(*file, 3);
+    int written = 0;
+    out.nb_rec = 0;
+    for (int i = 1; i <= nbBlocks; i++) {
+        readBlock(*file, i, &in);
+        for (int j = 0; j < in.nb_rec; j++) {
+            if (inKeySet(in.T[j].key, sortedKeys, n)) {
+                (*removed)++;
+                continue;
+            }
+            out.T[out.nb_rec++] = in.T[j];
+            if (out.nb_rec == blockCapacity) {
+                written++;
+                if (*removed > 0) writeBlock(*file, written, out);
+                out.nb_rec = 0;
+            }
+        }
+    }
+    if (out.nb_rec > 0) writeBlock(*file, ++written, out);
+    return written; // new last block
+}
+
+void deleteBatchTnOF(const char *filename, const int *keys, size_t n) //--- Delete every record whose key is in keys ---//
+{
+    TnOF file;
+    open(&file, filename, 'o');
+    if (file.f == NULL) {
+        printf("Error: Could not open file '%s'\n", filename);
+        return;
+    }
+    if (refusePacked(&file)) {
+        close(file);
+        return;
+    }
+    int *sorted = malloc(n * sizeof(int));
+    for (size_t k = 0; k < n; k++) sorted[k] = keys[k];
+    qsort(sorted, n, sizeof(int), compareKeys);
+
+    HashIndex *idx = indexOf(&file);
+    int removed = 0;
+    int front = 1, tail = getHeader(file, 1);
+    Tblock frontBuf, tailBuf;
+    tailBuf.nb_rec = 0;
+
+    if (file.header.sorted) tail = sortedDeleteBatch(&file, sorted, n, &removed);
+    else {
+        if (tail > 0) readBlock(file, tail, &tailBuf);
+
+        // 1: Single pass from the front, every hole is filled with the last surviving record of the file
+        while (front < tail) {
+            readBlock(file, front, &frontBuf);
+            int dirty = 0;
+            for (int j = 0; j < frontBuf.nb_rec; j++) {
+                if (!inKeySet(frontBuf.T[j].key, sorted, n)) continue;
+                if (idx != NULL) indexRemove(idx, frontBuf.T[j].key, front, j);
+                removed++;
+                dirty = 1;
+
+                int filled = 0;
+                while (!filled && front < tail) {
+                    if (tailBuf.nb_rec == 0) {
+                        tail--;
+                        if (front < tail) readBlock(file, tail, &tailBuf);
+                    } else {
+                        Record last = tailBuf.T[--tailBuf.nb_rec];
+                        if (inKeySet(last.key, sorted, n)) {
+                            if (idx != NULL) indexRemove(idx, last.key, tail, tailBuf.nb_rec);
+                            removed++;
+                        } else {
+                            if (idx != NULL) indexMove(idx, last.key, tail, tailBuf.nb_rec, front, j);
+                            frontBuf.T[j] = last;
+                            filled = 1;
+                        }
+                    }
+                }
+                if (!filled) { // the tail caught up with this block: fill the hole from its own end
+                    frontBuf.nb_rec--;
+                    if (j < frontBuf.nb_rec) {
+                        if (idx != NULL) indexMove(idx, frontBuf.T[frontBuf.nb_rec].key, front, frontBuf.nb_rec, front, j);
+                        frontBuf.T[j] = frontBuf.T[frontBuf.nb_rec];
+                    }
+                    j--;
+                }
+            }
+            if (front == tail) { // this block is now the last one
+                tailBuf = frontBuf;
+                break;
+            }
+            if (dirty) writeBlock(file, front, frontBuf);
+            front++;
+        }
+
+        // 2: Compact what is left of the last block in place
+        if (tail > 0) {
+            for (int j = 0; j < tailBuf.nb_rec; j++) {
+                if (!inKeySet(tailBuf.T[j].key, sorted, n)) continue;
+                if (idx != NULL) indexRemove(idx, tailBuf.T[j].key, tail, j);
+                removed++;
+                tailBuf.nb_rec--;
+                if (j < tailBuf.nb_rec) {
+                    if (idx != NULL) indexMove(idx, tailBuf.T[tailBuf.nb_rec].key, tail, tailBuf.nb_rec, tail, j);
+                    tailBuf.T[j] = tailBuf.T[tailBuf.nb_rec];
+                }
+                j--;
+            }
+            if (tailBuf.nb_rec > 0) writeBlock(file, tail, tailBuf);
+            else tail--;
+        }
+    }
+
+    // 3: Drop the freed blocks from the header and from the file
+    file.header.nb_block = tail;
+    file.header.nb_rec -= removed;
+    BloomFilter *bloom = bloomOf(&file);
+    if (bloom != NULL && removed > 0) { // records moved between blocks: rebuilt before the next lookup
+        bloom->stale = 1;
+        bloom->dirty = 1;
+    }
+    poolDropFrom(file.stats, tail + 1); // a write-back would extend the file again
+    if (file.map == NULL) sysResize(file.f, blockOffset(tail + 1)); // close() truncates mapped files
+    close(file);
+    free(sorted);
+    printf("%d records deleted from %s, %d blocks left\n", removed, filename, tail);
+}
+
+
+
+//--- Parallel sharded scan ---//
+
+#define SCAN_CHUNK 64   // blocks fetched by one pread
+
+typedef struct ScanShard
+{
+    const char *filename;
+    int first;              // blocks [first, last] of this worker
+    int last;
+    BlockVisitor visit;
+    void *ctx;
+    atomic_int *stop;       // shared by all workers, set by the first visitor asking to stop
+    const long *directory;  // packed file: offsets of its blocks, NULL for a raw file
+    long blocksRead;
+}ScanShard;
+
+static void *scanWorker(void *arg)
+{
+    ScanShard *shard = arg;
+    IOStats *stats = statsOf(shard->filename);
+    FILE *f = fopen(shard->filename, "rb");
+    STAT_ADD(stats, opens, 1);
+    if (f == NULL) return NULL;
+
+    Tblock *chunk = malloc(SCAN_CHUNK * sizeof(Tblock));
+    void *packed = shard->directory != NULL ? malloc(SCAN_CHUNK * PACKED_MAX_SIZE) : NULL;
+    int i = shard->first;
+    int rangeDone = 0;
+    while (i <= shard->last && !rangeDone && !atomic_load(shard->stop)) {
+        int count = shard->last - i + 1;
+        if (count > SCAN_CHUNK) count = SCAN_CHUNK;
+        long start = timerStart(), got;
+        if (packed != NULL) {
+            got = readPacked(f, shard->directory, i, count, packed, chunk); // decoded by the worker
+            STAT_TIME(stats, readNanos, start);
+            if (got < 0) break;
+        } else {
+            got = sysReadAt(f, chunk, count * sizeof(Tblock), blockOffset(i));
+            STAT_TIME(stats, readNanos, start);
+            if (got < (long)(count * sizeof(Tblock))) break;
+        }
+        STAT_ADD(stats, blockReads, count);
+        STAT_ADD(stats, bytesRead, got);
+
+        for (int b = 0; b < count && !rangeDone && !atomic_load(shard->stop); b++) {
+            shard->blocksRead++;
+            int verdict = shard->visit(&chunk[b], i + b, shard->ctx);
+            if (verdict == SCAN_STOP_RANGE) rangeDone = 1;
+            else if (verdict != 0) atomic_store(shard->stop, 1);
+        }
+        i += count;
+    }
+    free(chunk);
+    free(packed);
+    fclose(f);
+    STAT_ADD(stats, closes, 1);
+    return NULL;
+}
+
+long scanTnOF(const char *filename, int threads, BlockVisitor visit, void *ctx)
+{
+    IOStats *stats = statsOf(filename);
+    poolFlush(stats); // the workers read the file directly
+    Header header;
+    acquireFile(stats); // not compacted under the workers
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        releaseFile(stats);
+        return -1;
+    }
+    long got = sysReadAt(f, &header, sizeof(Header), 0);
+    long *directory = NULL;
+    if (got == sizeof(Header) && validHeader(&header) && header.encoding == ENCODING_PACKED) {
+        directory = loadDirectory(f, &header); // shared by the workers
+        if (directory == NULL) got = 0;
+    }
+    fclose(f);
+    if (got != sizeof(Header) || !validHeader(&header)) {
+        releaseFile(stats);
+        return -1;
+    }
+
+    if (threads < 1) threads = 1;
+    if (threads > header.nb_block) threads = header.nb_block > 0 ? header.nb_block : 1;
+
+    // contiguous shards, each worker reads its own range through its own descriptor
+    atomic_int stop = 0;
+    ScanShard *shards = malloc(threads * sizeof(ScanShard));
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    for (int t = 0; t < threads; t++) {
+        shards[t].filename = filename;
+        shards[t].first = 1 + (int)((long)t * header.nb_block / threads);
+        shards[t].last = (int)((long)(t + 1) * header.nb_block / threads);
+        shards[t].visit = visit;
+        shards[t].ctx = ctx;
+        shards[t].stop = &stop;
+        shards[t].directory = directory;
+        shards[t].blocksRead = 0;
+    }
+    if (threads == 1) {
+        scanWorker(&shards[0]); // in order, on the calling thread
+    } else {
+        for (int t = 0; t < threads; t++) pthread_create(&tids[t], NULL, scanWorker, &shards[t]);
+        for (int t = 0; t < threads; t++) pthread_join(tids[t], NULL);
+    }
+
+    releaseFile(stats);
+    long blocksRead = 0;
+    for (int t = 0; t < threads; t++) blocksRead += shards[t].blocksRead;
+    free(directory);
+    free(shards);
+    free(tids);
+    return blocksRead;
+}
+
+typedef struct SearchScan
+{
+    int key;
+    pthread_mutex_t lock;
+    atomic_int first;       // block of the first match so far, INT_MAX before any
+    int found;
+    int i;
+    int j;
+}SearchScan;
+
+//--- Keeps the first match: a worker stops at its own match, or once a match before its block is known ---//
+static int searchVisitor(const Tblock *block, int i, void *ctx)
+{
+    SearchScan *search = ctx;
+    if (atomic_load(&search->first) < i) return SCAN_STOP_RANGE; // the rest of this range comes after the match
+    int j = probeBlock(block, search->key);
+    if (j < 0) return 0;
+    pthread_mutex_lock(&search->lock);
+    if (!search->found || i < search->i) {
+        search->found = 1;
+        search->i = i;
+        search->j = j;
+        atomic_store(&search->first, i);
+    }
+    pthread_mutex_unlock(&search->lock);
+    return SCAN_STOP_RANGE; // the ranges before this one still run
+}
+
+void parallelSearchTnOF(const int key, const char *filename, int threads, int *found, int *i, int *j)
+{
+    SearchScan search;
+    search.key = key;
+    search.found = 0;
+    atomic_init(&search.first, INT_MAX);
+    pthread_mutex_init(&search.lock, NULL);
+    if (key != TOMBSTONE_KEY) scanTnOF(filename, threads, searchVisitor, &search);
+    pthread_mutex_destroy(&search.lock);
+
+    *found = search.found;
+    if (search.found) {
+        *i = search.i;
+        *j = search.j;
+        return;
+    }
+    // same insertion position as searchTnOF: after the last record
+    TnOF file;
+    Tblock buffer;
+    open(&file, filename, 'o');
+    *i = getHeader(file, 1);
+    *j = (*i > 0) ? peekBlock(file, *i, &buffer)->nb_rec : 0;
+    if (*i > 0 && *j >= getHeader(file, 3)) {
+        *i = *i + 1;
+        *j = 0;
+    }
+    close(file);
+}
+
+typedef struct CountScan
+{
+    int key;
+    atomic_long count;
+}CountScan;
+
+static int countVisitor(const Tblock *block, int i, void *ctx)
+{
+    CountScan *counter = ctx;
+    (void)i;
+    long matches = countInBlock(block, counter->key);
+    if (matches > 0) atomic_fetch_add(&counter->count, matches);
+    return 0;
+}
+
+long countTnOF(const int key, const char *filename, int threads)
+{
+    CountScan counter;
+    counter.key = key;
+    atomic_init(&counter.count, 0);
+    if (key != TOMBSTONE_KEY) scanTnOF(filename, threads, countVisitor, &counter);
+    return atomic_load(&counter.count);
+}
+
+
+void displayTnOF(const char *filename){
+    TnOF file;
+    Tblock buffer;
+
+    open(&file, filename, 'o');
+    int i=1,j,nb_blocks=getHeader(file, 1);
+
+
+    printf("Displaying header: \n");
+    printf("\t- Number of allocated blocks: %d\n\t- Total number of records: %d\n", nb_blocks, getHeader(file, 2));
+    if (file.header.sorted) printf("\t- Sorted by key (binary search)\n");
+    if (file.directory != NULL) printf("\t- Packed: %ld bytes of blocks instead of %ld\n",
+                                       file.directory[nb_blocks] - file.directory[0], (long)nb_blocks * BLOCK_SIZE);
+    if (file.header.tombstones > 0) printf("\t- Tombstones: %d (not displayed, reclaimed by compaction)\n", file.header.tombstones);
+    if (file.header.subFragments > 0) printf("\t- Split into %d sub-fragments (%s_0 .. %s_%d)\n",
+                                            file.header.subFragments, filename, filename, file.header.subFragments - 1);
+
+
+    while(i<=nb_blocks){
+        const Tblock *block = peekBlock(file, i, &buffer);
+        printf("Displaying block: %d  nb_rec=%d\n", i,block->nb_rec);
+
+        j = 0;
+        while (j < block->nb_rec)
+        {
+            if (block->T[j].key != TOMBSTONE_KEY) printf("\t- Key: %d\n", block->T[j].key); //--- Only display key (no info field) ---//
+            j++;
+        }
+        i++;
+    }
+    int subs = file.header.subFragments;
+    close(file);
+    for (int s = 0; s < subs; s++) {
+        char name[PATH_MAX];
+        formatName(name, sizeof(name), "%s_%d", filename, s);
+        printf("Sub-fragment %s:\n", name);
+        displayTnOF(name);
+    }
+}
+
+
+int hash(int key , int k)
+{
+return (key % k);
+}
+
+
+//--- Batched routing: hash(key, K) for a whole block without a division per record ---//
+
+void initRouter(FragmentRouter *router, int K)
+{
+    router->K = K;
+    router->mask = ((K & (K - 1)) == 0) ? K - 1 : -1;
+    router->reciprocal = UINT64_MAX / (uint32_t)K + 1; // fast modulo: a % K = ((reciprocal * a) * K) >> 64
+    router->inverse = 1.0 / K;
+}
+
+static void routeScalar(const FragmentRouter *router, const int *keys, int n, int *fragments)
+{
+#ifdef __SIZEOF_INT128__
+    for (int j = 0; j < n; j++) {
+        uint64_t low = router->reciprocal * (uint32_t)keys[j];
+        fragments[j] = (int)(((__uint128_t)low * (uint32_t)router->K) >> 64);
+    }
+#else
+    for (int j = 0; j < n; j++) fragments[j] = keys[j] % router->K;
+#endif
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//--- q = trunc(key * (1/K)) in double precision is off by at most one, r = key - q*K is then corrected ---//
+__attribute__((target("avx2")))
+static void routeAVX2(const FragmentRouter *router, const int *keys, int n, int *fragments)
+{
+    __m256d inverse = _mm256_set1_pd(router->inverse);
+    __m256i k = _mm256_set1_epi32(router->K);
+    __m256i kMinus1 = _mm256_set1_epi32(router->K - 1);
+    __m256i zero = _mm256_setzero_si256();
+    int j = 0;
+    for (; j + 8 <= n; j += 8) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(keys + j));
+        __m128i qLow = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(a)), inverse));
+        __m128i qHigh = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(a, 1)), inverse));
+        __m256i q = _mm256_inserti128_si256(_mm256_castsi128_si256(qLow), qHigh, 1);
+        __m256i r = _mm256_sub_epi32(a, _mm256_mullo_epi32(q, k));
+        r = _mm256_add_epi32(r, _mm256_and_si256(_mm256_cmpgt_epi32(zero, r), k));     // r < 0  -> r + K
+        r = _mm256_sub_epi32(r, _mm256_and_si256(_mm256_cmpgt_epi32(r, kMinus1), k)); // r >= K -> r - K
+        _mm256_storeu_si256((__m256i *)(fragments + j), r);
+    }
+    routeScalar(router, keys + j, n - j, fragments + j);
+}
+#endif
+
+void routeBlock(const FragmentRouter *router, const Tblock *block, int *fragments)
+{
+    const int *keys = &block->T[0].key;
+    int n = block->nb_rec;
+
+    int negative = 0;
+    for (int j = 0; j < n; j++) negative |= keys[j];
+    if (negative < 0) { // C's % keeps the sign of the key, the fast paths assume key >= 0
+        for (int j = 0; j < n; j++) fragments[j] = (keys[j] == TOMBSTONE_KEY) ? -1 : hash(keys[j], router->K); // tombstones are dropped
+        return;
+    }
+    if (router->mask >= 0) {
+        for (int j = 0; j < n; j++) fragments[j] = keys[j] & router->mask;
+        return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    static int avx2 = -1; // benign race: every thread computes the same value
+    if (avx2 < 0) {
+        __builtin_cpu_init();
+        avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    if (avx2) {
+        routeAVX2(router, keys, n, fragments);
+        return;
+    }
+#endif
+    routeScalar(router, keys, n, fragments);
+}
+
+//--- Counting sort of the records of a block by output buffer ---//
+// target[j] is the output buffer of record j, or -1 if it is not handled by this pass. On return the
+// records of buffer b are staged[start[b] .. start[b + 1] - 1].
+static void scatterBlock(const Record *recs, const int *target, int n, int numBuffers, Record *staged, int *start)
+{
+    for (int b = 0; b <= numBuffers; b++) start[b] = 0;
+    for (int j = 0; j < n; j++) start[target[j] + 1]++;
+    start[0] = 0; // records without a buffer (target -1) were counted there
+    for (int b = 0; b < numBuffers; b++) start[b + 1] += start[b];
+
+    int next[numBuffers];
+    for (int b = 0; b < numBuffers; b++) next[b] = start[b];
+    for (int j = 0; j < n; j++) {
+        if (target[j] >= 0) staged[next[target[j]]++] = recs[j];
+    }
+}
+
+
+//--- Fragments "<prefix><i>": "partition<i>" for the partitioned table, other prefixes for the fragments of a join ---//
+static void openNamedWriter(FragmentWriter *writer, const char *prefix, int first, int last)
+{
+    char filename[PATH_MAX];
+    writer->first = first;
+    writer->count = last - first + 1;
+    writer->files = malloc(writer->count * sizeof(TnOF));
+    writer->flushes = 0;
+    writer->ioCalls = 0;
+    writer->bytesWritten = 0;
+
+    for (int i = 0; i < writer->count; i++) {
+        formatName(filename, sizeof(filename), "%s%d", prefix, first + i);
+        open(&writer->files[i], filename, 'o');
+        writer->ioCalls += 2; // fopen + header fread
+    }
+}
+
+void openFragmentWriter(FragmentWriter *writer, int first, int last)
+{
+    openNamedWriter(writer, "partition", first, last);
+}
+
+void setFragmentKeys(FragmentWriter *writer, long keys)
+{
+    for (int i = 0; i < writer->count; i++) attachBloom(&writer->files[i], keys);
+}
+
+void fragmentWriterAppend(FragmentWriter *writer, int fragment, Tblock *buf)
+{
+    TnOF *fragFile = &writer->files[fragment - writer->first];
+    appendBlock(fragFile, *buf);
+    fragFile->header.nb_rec += buf->nb_rec;
+
+    writer->flushes++;
+    if (fragFile->map == NULL) writer->ioCalls += 2; // fseek + fwrite
+    writer->bytesWritten += sizeof(Tblock);
+    buf->nb_rec = 0;
+}
+
+void closeFragmentWriter(FragmentWriter *writer)
+{
+    for (int i = 0; i < writer->count; i++) {
+        close(writer->files[i]);
+        writer->ioCalls += 3; // rewind + header fwrite + fclose
+        writer->bytesWritten += sizeof(Header);
+    }
+    free(writer->files);
+    writer->files = NULL;
+}
+
+static void addWriterCost(PartitionCost *cost, FragmentWriter *writer)
+{
+    cost->blockWrites += writer->flushes;
+    cost->flushes += writer->flushes;
+    cost->ioCalls += writer->ioCalls;
+    cost->bytesWritten += writer->bytesWritten;
+}
+
+static void dropSubFragments(const char *filename);
+
+//--- Create K empty fragment files "<prefix><i>" with the given capacity ---//
+static void createFragments(const char *prefix, int K, int blockCapacity)
+{
+    char filename[PATH_MAX];
+    for (int i = 0; i < K; i++) {
+        formatName(filename, sizeof(filename), "%s%d", prefix, i);
+        dropSubFragments(filename); // left by a previous partitioning
+        TnOF fragFile;
+        open(&fragFile, filename, 'n');
+        fragFile.header.blockCapacity = blockCapacity;  // we work as if the fragmented file has the Same capacity as source
+        close(fragFile);
+    }
+}
+
+//--- Manifest: K, the block capacity and the header of every fragment, written after each partitioning ---//
+//--- then the linear hashing state, once it differs from key % K ---//
+static void writeManifest(int K, int blockCapacity, const Header *headers, const LinearHashing *lh)
+{
+    FILE *f = fopen(MANIFEST_FILE, "wb");
+    if (f == NULL) {
+        printf("Error: Could not write the manifest '%s'\n", MANIFEST_FILE);
+        return;
+    }
+    fwrite(&K, sizeof(int), 1, f);
+    fwrite(&blockCapacity, sizeof(int), 1, f);
+    fwrite(headers, sizeof(Header), K, f);
+    if (lh != NULL && (lh->level > 0 || lh->split > 0 || lh->splitBlocks > 0)) {
+        int magic = LINEAR_MAGIC;
+        fwrite(&magic, sizeof(int), 1, f);
+        fwrite(lh, sizeof(LinearHashing), 1, f);
+    }
+    fclose(f);
+}
+
+//--- Linear hashing state following the headers of the manifest; key % K when there is none ---//
+static void readLinearState(FILE *f, int K, LinearHashing *lh)
+{
+    int magic;
+    if (f != NULL && fread(&magic, sizeof(int), 1, f) == 1 && magic == LINEAR_MAGIC && fread(lh, sizeof(LinearHashing), 1, f) == 1
+        && lh->base > 0 && (lh->base << lh->level) + lh->split == K) return;
+    lh->base = K;
+    lh->level = 0;
+    lh->split = 0;
+    lh->splitBlocks = 0;
+}
+
+//--- Same from the manifest file, if it describes K fragments; returns the K of the manifest (0 without one) ---//
+static int loadLinearState(int K, LinearHashing *lh)
+{
+    int manifestK = 0;
+    FILE *f = fopen(MANIFEST_FILE, "rb");
+    if (f != NULL && fread(&manifestK, sizeof(int), 1, f) != 1) manifestK = 0;
+    if (f != NULL && (manifestK != K || fseek(f, sizeof(int) + K * sizeof(Header), SEEK_CUR) != 0)) {
+        fclose(f);
+        f = NULL;
+    }
+    readLinearState(f, K, lh);
+    if (f != NULL) fclose(f);
+    return manifestK;
+}
+
+int manifestFragments()
+{
+    LinearHashing lh;
+    return loadLinearState(0, &lh);
+}
+
+//--- Fragment of a key under a linear hashing state, -1 for negative keys ---//
+static int linearPartition(const LinearHashing *lh, int key)
+{
+    if (key < 0) return -1; // negative keys have no fragment
+    int round = lh->base << lh->level;
+    int p = hash(key, round);
+    if (p < lh->split) p = hash(key, 2 * round); // already split this round
+    return p;
+}
+
+//--- Routing of the filename functions: the state of the manifest, so they find what the handle put after its splits ---//
+static void loadRouting(int K, LinearHashing *lh)
+{
+    int manifestK = loadLinearState(K, lh);
+    if (manifestK > 0 && manifestK != K)
+        printf("Warning: The manifest describes %d fragments, keys are routed by key %% %d\n", manifestK, K);
+}
+
+static void saveManifest(int K, int blockCapacity, const LinearHashing *lh)
+{
+    Header *headers = malloc(K * sizeof(Header));
+    char filename[30];
+    for (int i = 0; i < K; i++) {
+        sprintf(filename, "partition%d", i);
+        TnOF fragFile;
+        open(&fragFile, filename, 'o');
+        headers[i] = fragFile.header;
+        close(fragFile);
+    }
+    writeManifest(K, blockCapacity, headers, lh);
+    free(headers);
+}
+
+static void printPartitionCost(int nbBlocks, int passes, PartitionCost cost, const IOStats *before)
+{
+    printf("Multi-pass cost model N x (passes + 1) = %d x %d = %d block operations\n", nbBlocks, passes + 1, nbBlocks * (passes + 1));
+    printf("Actual cost: %ld block reads + %ld block writes = %ld block operations\n",
+           cost.blockReads, cost.blockWrites, cost.blockReads + cost.blockWrites);
+    if (cost.flushes > 0) {
+        // reopening the fragment for every flush costs 9 calls and 2 blocks + 2 headers
+        printf("Fragment flushes: %ld, %.2f stdio calls and %.1f bytes written per flushed block (was 9 calls, %d bytes)\n",
+               cost.flushes, (double)cost.ioCalls / cost.flushes, (double)cost.bytesWritten / cost.flushes,
+               (int)(2 * sizeof(Tblock) + 2 * sizeof(Header)));
+    }
+    // what the I/O layer counted since the partitioning started, fragments, runs and source included
+    IOStats measured;
+    diffIOStats(getGlobalStats(), before, &measured);
+    printIOStats("Measured I/O", &measured);
+}
+
+
+//--- Skew: expected fragment sizes from a sample of the source, fragments over a size limit split into sub-fragments ---//
+// A split fragment keeps its (emptied) file with header.subFragments = n, its records live in "<file>_0" .. "<file>_<n-1>".
+// All the keys of fragment p have key % K == p, so the sub-fragment comes from a hash that mixes every bit of the key.
+
+static int fragmentLimit = 0;   // blocks, 0 = fragments are never split
+
+void setFragmentLimit(int blocks)
+{
+    fragmentLimit = blocks > 0 ? blocks : 0;
+}
+
+int getFragmentLimit()
+{
+    return fragmentLimit;
+}
+
+int subFragmentOf(int key, int n)
+{
+    uint32_t h = (uint32_t)key; // murmur3 finalizer
+    h ^= h >> 16;
+    h *= 0x85EBCA6B;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35;
+    h ^= h >> 16;
+    return (int)(h % (uint32_t)n);
+}
+
+static void subFragmentName(char *dst, size_t size, const char *filename, int s)
+{
+    formatName(dst, size, "%s_%d", filename, s);
+}
+
+//--- Sub-fragments of a file from its header alone (0: not split, or no such file) ---//
+static int subFragmentsOf(const char *filename)
+{
+    Header header;
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) return 0;
+    IOStats *stats = statsOf(filename);
+    STAT_ADD(stats, opens, 1);
+    STAT_ADD(stats, headerReads, 1);
+    STAT_ADD(stats, bytesRead, sizeof(Header));
+    int got = fread(&header, sizeof(Header), 1, f) == 1;
+    fclose(f);
+    return (got && validHeader(&header)) ? header.subFragments : 0;
+}
+
+//--- File holding key in fragment p: the fragment, or its sub-fragment when it is split ---//
+static void routedName(char *dst, size_t size, int key, int p)
+{
+    char fragment[30];
+    sprintf(fragment, "partition%d", p);
+    int n = subFragmentsOf(fragment);
+    if (n > 0) subFragmentName(dst, size, fragment, subFragmentOf(key, n));
+    else snprintf(dst, size, "%s", fragment);
+}
+
+static void dropSubFragments(const char *filename)
+{
+    char name[PATH_MAX];
+    int n = subFragmentsOf(filename);
+    for (int s = 0; s < n; s++) {
+        subFragmentName(name, sizeof(name), filename, s);
+        poolDropFrom(statsOf(name), 1);
+        remove(name);
+        dropIndex(name);
+        dropBloom(name);
+    }
+}
+
+void skewReport(const char *sourceFile, int K)
+{
+    TnOF file;
+    open(&file, sourceFile, 'o');
+    if (file.f == NULL) {
+        printf("Error: Could not open source file '%s'\n", sourceFile);
+        return;
+    }
+    int nbBlocks = getHeader(file, 1);
+    int blockCapacity = getHeader(file, 3);
+    int step = nbBlocks / SKEW_SAMPLE_BLOCKS > 1 ? nbBlocks / SKEW_SAMPLE_BLOCKS : 1;
+    long *counts = calloc(K, sizeof(long));
+    long sampled = 0;
+    int blocks = 0;
+    Tblock buffer;
+    for (int i = 1; i <= nbBlocks; i += step) {
+        const Tblock *block = peekBlock(file, i, &buffer);
+        for (int j = 0; j < block->nb_rec; j++) {
+            if (block->T[j].key < 0) continue; // negative keys have no fragment
+            counts[hash(block->T[j].key, K)]++;
+            sampled++;
+        }
+        blocks++;
+    }
+    long nbRec = getHeader(file, 2);
+    close(file);
+    if (sampled == 0) {
+        printf("Error: Source file is empty!\n");
+        free(counts);
+        return;
+    }
+
+    // every sampled record stands for nbRec / sampled records of the source
+    double scale = (double)nbRec / sampled, mean = (double)nbRec / K;
+    int largest = 0, over = 0;
+    for (int p = 0; p < K; p++) {
+        if (counts[p] > counts[largest]) largest = p;
+        if (fragmentLimit > 0 && counts[p] * scale > (double)fragmentLimit * blockCapacity) over++;
+    }
+    printf("Skew pre-pass: %d of %d blocks sampled, %ld records\n", blocks, nbBlocks, sampled);
+    printf("Expected fragment size: mean %.0f records, max %.0f (partition%d), imbalance %.2f (max / mean)\n",
+           mean, counts[largest] * scale, largest, counts[largest] * scale / mean);
+    int listed = 0;
+    for (int p = 0; p < K; p++) {
+        double expected = counts[p] * scale;
+        int hot = (fragmentLimit > 0) ? expected > (double)fragmentLimit * blockCapacity : expected > 2 * mean;
+        if (K > 16 && !hot) continue; // small tables are listed whole, large ones only their hot fragments
+        if (listed++ == 16) {
+            printf("\t- ...\n");
+            break;
+        }
+        printf("\t- partition%d: %.0f records, %.1f blocks%s\n", p, expected, expected / blockCapacity, hot ? " (hot)" : "");
+    }
+    if (fragmentLimit > 0) printf("%d fragments expected over the %d-block limit\n", over, fragmentLimit);
+    free(counts);
+}
+
+//--- Move the records of a fragment into n sub-fragments, M - 1 of them per pass over it; the fragment is left empty ---//
+static void splitHotFragment(const char *filename, int n, int M)
+{
+    TnOF fragment;
+    open(&fragment, filename, 'o');
+    if (fragment.f == NULL) return;
+    int blockCapacity = getHeader(fragment, 3);
+    int nbBlocks = getHeader(fragment, 1);
+    int perPass = (M - 1 > 1) ? M - 1 : 1;
+    TnOF *subs = malloc(perPass * sizeof(TnOF));
+    Tblock *outputs = malloc(perPass * sizeof(Tblock));
+    Tblock buffer;
+    char name[PATH_MAX];
+    for (int first = 0; first < n; first += perPass) {
+        int count = (n - first < perPass) ? n - first : perPass;
+        for (int s = 0; s < count; s++) {
+            subFragmentName(name, sizeof(name), filename, first + s);
+            open(&subs[s], name, 'n');
+            subs[s].header.blockCapacity = blockCapacity;
+            subs[s].header.sorted = fragment.header.sorted; // each sub-fragment keeps the order of the fragment
+            attachBloom(&subs[s], fragment.header.nb_rec / n + 1);
+            outputs[s].nb_rec = 0;
+        }
+        for (int i = 1; i <= nbBlocks; i++) {
+            const Tblock *block = peekBlock(fragment, i, &buffer);
+            for (int j = 0; j < block->nb_rec; j++) {
+                if (block->T[j].key == TOMBSTONE_KEY) continue; // reclaimed on the way
+                int s = subFragmentOf(block->T[j].key, n) - first;
+                if (s < 0 || s >= count) continue; // written by another pass
+                outputs[s].T[outputs[s].nb_rec++] = block->T[j];
+                if (outputs[s].nb_rec == blockCapacity) {
+                    appendBlock(&subs[s], outputs[s]);
+                    subs[s].header.nb_rec += blockCapacity;
+                    outputs[s].nb_rec = 0;
+                }
+            }
+        }
+        for (int s = 0; s < count; s++) {
+            if (outputs[s].nb_rec > 0) {
+                appendBlock(&subs[s], outputs[s]);
+                subs[s].header.nb_rec += outputs[s].nb_rec;
+            }
+            close(subs[s]);
+        }
+    }
+    free(subs);
+    free(outputs);
+
+    fragment.header.nb_block = 0;
+    fragment.header.nb_rec = 0;
+    fragment.header.tombstones = 0;
+    fragment.header.subFragments = n;
+    fragment.header.encoding = ENCODING_RAW; // a packed fragment left without blocks needs no directory
+    poolDropFrom(fragment.stats, 1);
+    if (fragment.map == NULL) sysResize(fragment.f, blockOffset(1)); // close() truncates mapped files
+    close(fragment);
+    dropIndex(filename);
+    dropBloom(filename);
+}
+
+//--- Blocks and records of fragment p, sub-fragments included; *largestFile gets its largest file ---//
+static void fragmentSize(int p, int *blocks, long *records, int *subs, int *largestFile)
+{
+    char filename[30], name[48];
+    sprintf(filename, "partition%d", p);
+    *blocks = 0, *records = 0, *largestFile = 0;
+    *subs = subFragmentsOf(filename);
+    for (int s = 0; s < (*subs > 0 ? *subs : 1); s++) {
+        if (*subs > 0) subFragmentName(name, sizeof(name), filename, s);
+        else strcpy(name, filename);
+        TnOF file;
+        open(&file, name, 'o');
+        if (file.f == NULL) continue;
+        *blocks += getHeader(file, 1);
+        *records += getHeader(file, 2);
+        if (getHeader(file, 1) > *largestFile) *largestFile = getHeader(file, 1);
+        close(file);
+    }
+}
+
+//--- Split the fragments over the limit, then print the size of every fragment and the imbalance ---//
+static void balanceFragments(int K, int M)
+{
+    char filename[30];
+    int split = 0;
+    for (int p = 0; p < K && fragmentLimit > 0; p++) {
+        sprintf(filename, "partition%d", p);
+        TnOF fragFile;
+        open(&fragFile, filename, 'o');
+        if (fragFile.f == NULL) continue;
+        int nbBlocks = getHeader(fragFile, 1);
+        int subs = fragFile.header.subFragments;
+        close(fragFile);
+        if (subs > 0 || nbBlocks <= fragmentLimit) continue;
+        int n = (nbBlocks + fragmentLimit - 1) / fragmentLimit;
+        splitHotFragment(filename, n, M);
+        printf("Partition %d (%d blocks) split into %d sub-fragments\n", p, nbBlocks, n);
+        split++;
+    }
+
+    long total = 0;
+    int largest = 0, smallest = 0, largestFile = 0, overLimit = 0, files = 0;
+    int *blocks = malloc(K * sizeof(int));
+    for (int p = 0; p < K; p++) {
+        long records;
+        int subs, fileBlocks;
+        fragmentSize(p, &blocks[p], &records, &subs, &fileBlocks);
+        total += blocks[p];
+        files += (subs > 0) ? subs : 1;
+        if (blocks[p] > blocks[largest]) largest = p;
+        if (blocks[p] < blocks[smallest]) smallest = p;
+        if (fileBlocks > largestFile) largestFile = fileBlocks;
+        if (fragmentLimit > 0 && fileBlocks > fragmentLimit) overLimit++; // a hot key cannot be split by hashing
+        if (K <= 16) {
+            printf("\t- partition%d: %ld records, %d blocks", p, records, blocks[p]);
+            if (subs > 0) printf(" in %d sub-fragments (largest %d blocks)", subs, fileBlocks);
+            printf("\n");
+        }
+    }
+    double mean = (double)total / K;
+    printf("Fragment sizes: min %d, mean %.1f, max %d blocks (partition%d), imbalance %.2f (max / mean)\n",
+           blocks[smallest], mean, blocks[largest], largest, mean > 0 ? blocks[largest] / mean : 1.0);
+    if (fragmentLimit > 0) {
+        double fileMean = (double)total / files;
+        printf("%d fragments split at the %d-block limit: %d files, largest %d blocks, imbalance %.2f across files\n",
+               split, fragmentLimit, files, largestFile, fileMean > 0 ? largestFile / fileMean : 1.0);
+        if (overLimit > 0) printf("%d fragments still hold a file over the limit: duplicates of a hot key stay together\n", overLimit);
+    }
+    free(blocks);
+}
+
+void balancePartitions(int K, int M)
+{
+    char filename[30];
+    int blockCapacity = 0;
+    for (int p = 0; p < K; p++) {
+        sprintf(filename, "partition%d", p);
+        TnOF fragFile;
+        open(&fragFile, filename, 'o');
+        if (fragFile.f == NULL) {
+            printf("Error: Partition %d does not exist. Please partition the file first.\n", p);
+            return;
+        }
+        blockCapacity = getHeader(fragFile, 3);
+        close(fragFile);
+    }
+    balanceFragments(K, M);
+    LinearHashing lh;
+    loadLinearState(K, &lh);
+    saveManifest(K, blockCapacity, &lh);
+}
+
+//--- Source of a partition pass: its blocks in order, a chunk at a time with O_DIRECT when direct I/O is on (decoded when packed) ---//
+// The chunk is the caller's input buffer: it holds the blocks the caller can spare out of M, SCAN_CHUNK at most.
+typedef struct SourceReader
+{
+    TnOF file;
+    FILE *direct;       // O_DIRECT descriptor, NULL when the blocks come from the file handle
+    void *packed;       // packed source: chunkSize encoded blocks read at once, decoded into chunk
+    Tblock *chunk;      // page-aligned, chunkSize blocks
+    int chunkSize;
+    int chunkFirst;     // blocks [chunkFirst, chunkFirst + chunkCount - 1] are in chunk
+    int chunkCount;
+}SourceReader;
+
+static void openSource(SourceReader *reader, const char *filename, int blocks)
+{
+    open(&reader->file, filename, 'o');
+    reader->direct = NULL;
+    reader->packed = NULL;
+    reader->chunk = NULL;
+    reader->chunkSize = blocks < 1 ? 1 : (blocks > SCAN_CHUNK ? SCAN_CHUNK : blocks);
+    reader->chunkFirst = 0;
+    reader->chunkCount = 0;
+    if (reader->file.f != NULL && reader->file.directory != NULL) { // unaligned blocks: no O_DIRECT
+        reader->packed = malloc(reader->chunkSize * PACKED_MAX_SIZE);
+        reader->chunk = malloc(reader->chunkSize * sizeof(Tblock));
+        return;
+    }
+    if (!directIO || reader->file.f == NULL || reader->file.map != NULL) return;
+    poolFlush(reader->file.stats); // the direct reads skip the pool
+    reader->direct = sysOpenDirect(filename);
+    if (reader->direct == NULL) return; // no O_DIRECT on this file system: buffered reads
+    STAT_ADD(reader->file.stats, opens, 1);
+    reader->chunk = sysAlignedAlloc(reader->chunkSize * sizeof(Tblock));
+}
+
+static const Tblock *sourceBlock(SourceReader *reader, int i, Tblock *buf)
+{
+    if (reader->chunk == NULL || i > reader->file.header.nb_block) return peekBlock(reader->file, i, buf);
+    if (i < reader->chunkFirst || i >= reader->chunkFirst + reader->chunkCount) {
+        int count = reader->file.header.nb_block - i + 1;
+        if (count > reader->chunkSize) count = reader->chunkSize;
+        long start = timerStart();
+        reader->chunkFirst = i;
+        if (reader->packed != NULL) {
+            long got = readPacked(reader->file.f, reader->file.directory, i, count, reader->packed, reader->chunk);
+            reader->chunkCount = got >= 0 ? count : 0;
+            STAT_ADD(reader->file.stats, bytesRead, got > 0 ? got : 0);
+        } else {
+            long got = sysReadAt(reader->direct, reader->chunk, count * sizeof(Tblock), blockOffset(i));
+            reader->chunkCount = got > 0 ? (int)(got / sizeof(Tblock)) : 0;
+            STAT_ADD(reader->file.stats, bytesRead, (long)reader->chunkCount * sizeof(Tblock));
+        }
+        STAT_TIME(reader->file.stats, readNanos, start);
+        STAT_ADD(reader->file.stats, blockReads, reader->chunkCount);
+        if (reader->chunkCount == 0) return peekBlock(reader->file, i, buf);
+    }
+    return &reader->chunk[i - reader->chunkFirst];
+}
+
+static void closeSource(SourceReader *reader)
+{
+    if (reader->direct != NULL) {
+        fclose(reader->direct);
+        STAT_ADD(reader->file.stats, closes, 1);
+    }
+    free(reader->packed);
+    free(reader->chunk);
+    close(reader->file);
+}
+
+
+//--- Asynchronous pass pipeline: a reader thread keeps read-ahead on the source, a writer thread appends the full buffers ---//
+// The pipeline owns inFlight + 1 blocks of the M buffers (the input block and the blocks in flight);
+// a full output buffer is swapped with a free block and queued, so the pass never waits on a write.
+static int asyncDepth = 0;
+
+void setAsyncIO(int buffers)
+{
+    asyncDepth = buffers > 0 ? buffers : 0;
+}
+
+int getAsyncIO()
+{
+    return asyncDepth;
+}
+
+//--- Buffers of a budget of M given to the pipeline: at least 2 output buffers are left ---//
+static int asyncBuffers(int M)
+{
+    int inFlight = asyncDepth;
+    if (inFlight > M - 3) inFlight = M - 3;
+    return inFlight > 0 ? inFlight : 0;
+}
+
+typedef struct PendingWrite
+{
+    FragmentWriter *writer; // fragment output, or
+    int fragment;
+    TnOF *run;              // overflow run output when writer is NULL
+    Tblock *buf;
+}PendingWrite;
+
+typedef struct IOPipeline
+{
+    SourceReader *source;
+    int nbBlocks;
+    int size;               // blocks owned by the pipeline
+    Tblock *blocks;
+    Tblock **free;          // stack of free blocks
+    int nbFree;
+    Tblock **ready;         // ring of read-ahead blocks, in source order
+    int readyHead, readyCount;
+    PendingWrite *writes;   // ring of queued writes, appended in order
+    int writeHead, writeCount;
+    Tblock *input;          // block being consumed, freed by the next pipelineNext
+    int closing;
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // signalled on every queue change, the queues are small
+    pthread_t reader, writer;
+}IOPipeline;
+
+//--- Write a full output buffer to its fragment or overflow run, then empty it ---//
+static void writeOutput(FragmentWriter *writer, int fragment, TnOF *run, Tblock *buf)
+{
+    if (writer != NULL) {
+        fragmentWriterAppend(writer, fragment, buf);
+        return;
+    }
+    appendBlock(run, *buf);
+    run->header.nb_rec += buf->nb_rec;
+    buf->nb_rec = 0;
+}
+
+static void *pipelineReader(void *arg)
+{
+    IOPipeline *pipe = arg;
+    for (int i = 1; i <= pipe->nbBlocks; i++) {
+        pthread_mutex_lock(&pipe->lock);
+        while (pipe->nbFree < 2) pthread_cond_wait(&pipe->changed, &pipe->lock); // one stays free for the swaps
+        Tblock *buf = pipe->free[--pipe->nbFree];
+        pthread_mutex_unlock(&pipe->lock);
+
+        const Tblock *block = sourceBlock(pipe->source, i, buf);
+        if (block != buf) *buf = *block;
+
+        pthread_mutex_lock(&pipe->lock);
+        pipe->ready[(pipe->readyHead + pipe->readyCount) % pipe->size] = buf;
+        pipe->readyCount++;
+        pthread_cond_broadcast(&pipe->changed);
+        pthread_mutex_unlock(&pipe->lock);
+    }
+    return NULL;
+}
+
+static void *pipelineWriter(void *arg)
+{
+    IOPipeline *pipe = arg;
+    pthread_mutex_lock(&pipe->lock);
+    while (1) {
+        while (pipe->writeCount == 0 && !pipe->closing) pthread_cond_wait(&pipe->changed, &pipe->lock);
+        if (pipe->writeCount == 0) break;
+        PendingWrite w = pipe->writes[pipe->writeHead];
+        pthread_mutex_unlock(&pipe->lock);
+
+        writeOutput(w.writer, w.fragment, w.run, w.buf);
+
+        pthread_mutex_lock(&pipe->lock);
+        pipe->writeHead = (pipe->writeHead + 1) % pipe->size;
+        pipe->writeCount--;
+        pipe->free[pipe->nbFree++] = w.buf;
+        pthread_cond_broadcast(&pipe->changed);
+    }
+    pthread_mutex_unlock(&pipe->lock);
+    return NULL;
+}
+
+//--- NULL (synchronous pass) when no buffer is left for the pipeline ---//
+static IOPipeline *openPipeline(SourceReader *source, int inFlight)
+{
+    if (inFlight < 1) return NULL;
+    IOPipeline *pipe = malloc(sizeof(IOPipeline));
+    pipe->source = source;
+    pipe->nbBlocks = source->file.header.nb_block;
+    pipe->size = inFlight + 1;
+    pipe->blocks = malloc(pipe->size * sizeof(Tblock));
+    pipe->free = malloc(pipe->size * sizeof(Tblock *));
+    pipe->ready = malloc(pipe->size * sizeof(Tblock *));
+    pipe->writes = malloc(pipe->size * sizeof(PendingWrite));
+    for (int b = 0; b < pipe->size; b++) pipe->free[b] = &pipe->blocks[b];
+    pipe->nbFree = pipe->size;
+    pipe->readyHead = pipe->readyCount = 0;
+    pipe->writeHead = pipe->writeCount = 0;
+    pipe->input = NULL;
+    pipe->closing = 0;
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->changed, NULL);
+    pthread_create(&pipe->reader, NULL, pipelineReader, pipe);
+    pthread_create(&pipe->writer, NULL, pipelineWriter, pipe);
+    return pipe;
+}
+
+//--- Block i of the source, read ahead by the pipeline (blocks are asked for in order) ---//
+static const Tblock *pipelineNext(IOPipeline *pipe, SourceReader *source, int i, Tblock *buf)
+{
+    if (pipe == NULL) return sourceBlock(source, i, buf);
+    pthread_mutex_lock(&pipe->lock);
+    if (pipe->input != NULL) pipe->free[pipe->nbFree++] = pipe->input;
+    while (pipe->readyCount == 0) {
+        pthread_cond_broadcast(&pipe->changed);
+        pthread_cond_wait(&pipe->changed, &pipe->lock);
+    }
+    pipe->input = pipe->ready[pipe->readyHead];
+    pipe->readyHead = (pipe->readyHead + 1) % pipe->size;
+    pipe->readyCount--;
+    pthread_cond_broadcast(&pipe->changed);
+    pthread_mutex_unlock(&pipe->lock);
+    return pipe->input;
+}
+
+//--- *slot is full: written now, or queued and replaced by a free block of the pipeline ---//
+static void pipelineWrite(IOPipeline *pipe, FragmentWriter *writer, int fragment, TnOF *run, Tblock **slot)
+{
+    if (pipe == NULL) {
+        writeOutput(writer, fragment, run, *slot);
+        return;
+    }
+    pthread_mutex_lock(&pipe->lock);
+    while (pipe->nbFree == 0) pthread_cond_wait(&pipe->changed, &pipe->lock);
+    Tblock *empty = pipe->free[--pipe->nbFree];
+    pipe->writes[(pipe->writeHead + pipe->writeCount) % pipe->size] = (PendingWrite){writer, fragment, run, *slot};
+    pipe->writeCount++;
+    pthread_cond_broadcast(&pipe->changed);
+    pthread_mutex_unlock(&pipe->lock);
+    empty->nb_rec = 0;
+    *slot = empty;
+}
+
+//--- Wait for the queued writes; the outputs may now point into the pipeline's blocks, returned for the final flush ---//
+static Tblock *closePipeline(IOPipeline *pipe)
+{
+    if (pipe == NULL) return NULL;
+    pthread_join(pipe->reader, NULL);
+    pthread_mutex_lock(&pipe->lock);
+    pipe->closing = 1;
+    pthread_cond_broadcast(&pipe->changed);
+    pthread_mutex_unlock(&pipe->lock);
+    pthread_join(pipe->writer, NULL);
+    pthread_mutex_destroy(&pipe->lock);
+    pthread_cond_destroy(&pipe->changed);
+    Tblock *blocks = pipe->blocks; // freed by the caller once its output buffers are flushed
+    free(pipe->free);
+    free(pipe->ready);
+    free(pipe->writes);
+    free(pipe);
+    return blocks;
+}
+
+
+//--- Fragment of a key when a join repartitions a fragment: all its keys share their fragment, level n mixes them with its own seed ---//
+static int joinRoute(int key, int level, int n)
+{
+    return subFragmentOf(key ^ (int)((unsigned)(level - 2) * 0x9E3779B9u), n); // level 2 is the sub-fragment hash
+}
+
+//--- One pass: read the whole source and write the fragments "<prefix><startFragment>" .. "<prefix><endFragment>" ---//
+// Level 0 routes by hash(key, K) like every partitioning: negative keys have no fragment. Level 1 routes the inputs of a
+// join by (unsigned)key % K, so that no key is lost, and level n > 1 by joinRoute() when a join splits a fragment again.
+static void partitionPass(const char *sourceFile, const char *prefix, int K, int level, int startFragment, int endFragment,
+                          int blockCapacity, int perPass, int inFlight, PartitionCost *cost)
+{
+    int numBuffers = endFragment - startFragment + 1;  // actual number of fragments in this pass
+
+    // Initialize output buffers for this pass
+    Tblock *outputBuffers = malloc(numBuffers * sizeof(Tblock)); // too large for the stack with 4 KiB blocks
+    Tblock **outputs = malloc(numBuffers * sizeof(Tblock *));    // swapped with free blocks by the pipeline
+    for (int i = 0; i < numBuffers; i++) {
+        outputBuffers[i].nb_rec = 0;
+        outputs[i] = &outputBuffers[i];
+    }
+
+    // Open this pass's fragments once, then read all source blocks
+    FragmentWriter writer;
+    openNamedWriter(&writer, prefix, startFragment, endFragment);
+    SourceReader source;
+    openSource(&source, sourceFile, 1 + perPass - numBuffers); // the input buffer and the outputs this pass leaves unused
+    int nbBlocks = getHeader(source.file, 1);
+    setFragmentKeys(&writer, getHeader(source.file, 2) / K);
+    IOPipeline *pipe = openPipeline(&source, inFlight);
+    FragmentRouter router;
+    initRouter(&router, K);
+    int target[MAX_RECORDS], start[numBuffers + 1];
+    Record staged[MAX_RECORDS];
+
+    for (int blockNum = 1; blockNum <= nbBlocks; blockNum++) {
+        Tblock inputBuffer;
+        const Tblock *input = pipelineNext(pipe, &source, blockNum, &inputBuffer);
+        cost->blockReads++;
+
+        // Hash the whole block, keep the records of this pass and group them by output buffer
+        if (level <= 1) routeBlock(&router, input, target);
+        else for (int j = 0; j < input->nb_rec; j++) target[j] = joinRoute(input->T[j].key, level, K);
+        for (int j = 0; level == 1 && j < input->nb_rec; j++) {
+            int key = input->T[j].key;
+            if (key < 0 && key != TOMBSTONE_KEY) target[j] = (int)((unsigned)key % (unsigned)K);
+        }
+        for (int j = 0; j < input->nb_rec; j++) {
+            int bufferIndex = target[j] - startFragment;
+            target[j] = ((unsigned)bufferIndex < (unsigned)numBuffers) ? bufferIndex : -1;
+        }
+        scatterBlock(input->T, target, input->nb_rec, numBuffers, staged, start);
+
+        // Copy each group into its output buffer, writing the buffer to its fragment whenever it is full
+        for (int b = 0; b < numBuffers; b++) {
+            int r = start[b];
+            while (r < start[b + 1]) {
+                Tblock *out = outputs[b];
+                int room = blockCapacity - out->nb_rec;
+                int take = start[b + 1] - r;
+                if (take > room) take = room;
+                memcpy(&out->T[out->nb_rec], &staged[r], take * sizeof(Record));
+                out->nb_rec += take;
+                r += take;
+                if (out->nb_rec >= blockCapacity) {
+                    pipelineWrite(pipe, &writer, startFragment + b, NULL, &outputs[b]); // also resets the buffer
+                }
+            }
+        }
+    }
+
+    Tblock *pipeBlocks = closePipeline(pipe);
+    closeSource(&source);
+
+    // Flush remaining non-empty buffers
+    for (int i = 0; i < numBuffers; i++) {
+        if (outputs[i]->nb_rec > 0) {
+            fragmentWriterAppend(&writer, startFragment + i, outputs[i]);
+        }
+    }
+    free(pipeBlocks);
+    free(outputs);
+    free(outputBuffers);
+    closeFragmentWriter(&writer);
+    addWriterCost(cost, &writer);
+}
+
+
+void partition(const char *sourceFile, int K, int M) {
+    IOStats before = *getGlobalStats();
+    // Step 1: Calculate number of passes needed
+    int inFlight = asyncBuffers(M);       // read-ahead and queued writes count against the M buffers
+    int perPass = M - 1 - inFlight;
+    int passes = (K + perPass - 1) / perPass;  // ceiling of K/(M-1) when synchronous
+    printf("Partitioning into %d fragments using %d buffers\n", K, M);
+    if (inFlight > 0) printf("Asynchronous I/O: %d buffers in flight, %d output buffers per pass\n", inFlight, perPass);
+    printf("Number of passes required: %d\n", passes);
+
+    // Step 2: Get blockCapacity and the nbBlocks from source file
+    TnOF srcFile;
+    open(&srcFile, sourceFile, 'o');
+    if (srcFile.f == NULL) {
+        printf("Error: Could not open source file '%s'\n", sourceFile);
+        return;
+    }
+    int blockCapacity = getHeader(srcFile, 3);
+    int nbBlocks = getHeader(srcFile, 1);
+    printf("Source file: %d blocks, blockCapacity=%d\n", nbBlocks, blockCapacity);
+    close(srcFile);
+    
+    if (nbBlocks == 0) {
+        printf("Error: Source file is empty!\n");
+        return;
+    }    
+
+    if (fragmentLimit > 0) skewReport(sourceFile, K);
+
+    // Step 3: Create K empty fragment files with same blockCapacity
+    PartitionCost cost = {0, 0, 0, 0, 0};
+    createFragments("partition", K, blockCapacity);
+
+    // Step 4: Multi-pass algorithm
+    for (int pass = 0; pass < passes; pass++) {
+        // Calculate fragment range for this pass
+        int startFragment = pass * perPass;
+        int endFragment = startFragment + perPass - 1;
+        if (endFragment >= K) endFragment = K - 1;
+        
+        printf("\nPass %d: Processing fragments %d to %d (%d buffers)\n", pass + 1, startFragment, endFragment,
+               endFragment - startFragment + 1);
+        partitionPass(sourceFile, "partition", K, 0, startFragment, endFragment, blockCapacity, perPass, inFlight, &cost);
+    }
+
+    balanceFragments(K, M);
+    saveManifest(K, blockCapacity, NULL);
+    printf("\nPartitioning complete! Created %d fragment files.\n", K);
+    printPartitionCost(nbBlocks, passes, cost, &before);
+}
+
+
+//--- Parallel multi-pass partitioning: workers take fragment ranges from a shared counter ---//
+typedef struct PartitionJob
+{
+    const char *sourceFile;
+    int K;
+    int perPass;            // output buffers of each worker
+    int inFlight;           // pipeline buffers of each worker
+    int blockCapacity;
+    int nextPass;           // next fragment range to hand out, protected by lock
+    int passes;
+    pthread_mutex_t lock;
+}PartitionJob;
+
+typedef struct PartitionWorker
+{
+    PartitionJob *job;
+    PartitionCost cost;     // merged by partitionParallel once the worker is joined
+}PartitionWorker;
+
+static void *partitionWorker(void *arg)
+{
+    PartitionWorker *worker = arg;
+    PartitionJob *job = worker->job;
+    while (1) {
+        pthread_mutex_lock(&job->lock);
+        int pass = job->nextPass++;
+        pthread_mutex_unlock(&job->lock);
+        if (pass >= job->passes) break;
+
+        int startFragment = pass * job->perPass;
+        int endFragment = startFragment + job->perPass - 1;
+        if (endFragment >= job->K) endFragment = job->K - 1;
+        partitionPass(job->sourceFile, "partition", job->K, 0, startFragment, endFragment, job->blockCapacity,
+                      job->perPass, job->inFlight, &worker->cost);
+    }
+    return NULL;
+}
+
+void partitionParallel(const char *sourceFile, int K, int M, int threads) {
+    IOStats before = *getGlobalStats();
+    // Step 1: Split the M buffers between the workers, one input buffer each
+    if (threads > M / 2) {
+        threads = M / 2;  // every worker needs an input buffer and at least one output buffer
+        printf("Only %d threads fit in %d buffers\n", threads, M);
+    }
+    if (threads < 1) threads = 1;
+    int inFlight = asyncBuffers(M / threads);
+    int perPass = M / threads - 1 - inFlight;
+    int passes = (K + perPass - 1) / perPass;
+    printf("Partitioning into %d fragments using %d buffers on %d threads\n", K, M, threads);
+    if (inFlight > 0) printf("Asynchronous I/O: %d buffers in flight per thread\n", inFlight);
+    printf("Number of passes required: %d (%d output buffers per thread)\n", passes, perPass);
+
+    TnOF srcFile;
+    open(&srcFile, sourceFile, 'o');
+    if (srcFile.f == NULL) {
+        printf("Error: Could not open source file '%s'\n", sourceFile);
+        return;
+    }
+    int blockCapacity = getHeader(srcFile, 3);
+    int nbBlocks = getHeader(srcFile, 1);
+    printf("Source file: %d blocks, blockCapacity=%d\n", nbBlocks, blockCapacity);
+    close(srcFile);
+
+    if (nbBlocks == 0) {
+        printf("Error: Source file is empty!\n");
+        return;
+    }
+
+    if (fragmentLimit > 0) skewReport(sourceFile, K);
+
+    // Step 2: Run the passes on the workers
+    createFragments("partition", K, blockCapacity);
+    PartitionJob job = {.sourceFile = sourceFile, .K = K, .perPass = perPass, .inFlight = inFlight,
+                        .blockCapacity = blockCapacity, .nextPass = 0, .passes = passes};
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    PartitionWorker *workers = malloc(threads * sizeof(PartitionWorker));
+    for (int t = 0; t < threads; t++) {
+        workers[t].job = &job;
+        workers[t].cost = (PartitionCost){0, 0, 0, 0, 0};
+        pthread_create(&tids[t], NULL, partitionWorker, &workers[t]);
+    }
+
+    PartitionCost cost = {0, 0, 0, 0, 0};
+    for (int t = 0; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+        cost.blockReads += workers[t].cost.blockReads;
+        cost.blockWrites += workers[t].cost.blockWrites;
+        cost.flushes += workers[t].cost.flushes;
+        cost.ioCalls += workers[t].cost.ioCalls;
+        cost.bytesWritten += workers[t].cost.bytesWritten;
+    }
+    pthread_mutex_destroy(&job.lock);
+    free(tids);
+    free(workers);
+
+    balanceFragments(K, M);
+    saveManifest(K, blockCapacity, NULL);
+    printf("\nPartitioning complete! Created %d fragment files.\n", K);
+    printPartitionCost(nbBlocks, passes, cost, &before);
+}
+
+
+//--- Partition the fragments [first, last] found in runFile, reading runFile exactly once ---//
+// Fragments that get no dedicated output buffer are grouped into overflow runs (temporary
+// TnOF files) which are then partitioned recursively, as in hybrid hash partitioning.
+static void partitionRange(const char *runFile, int K, int M, int first, int last,
+                           int blockCapacity, int depth, PartitionCost *cost)
+{
+    int count = last - first + 1;
+    int inFlight = asyncBuffers(M);
+    int buffers = M - inFlight; // the pipeline's buffers count against M
+    assert(buffers >= 3); // one input, one dedicated output and one overflow run at least (M >= 3 leaves that much)
+    int runs = 0;
+    if (count > buffers - 1) {
+        // with R runs, B-1-R fragments stay dedicated and each run should hold at most B-1 fragments
+        runs = count / buffers;
+        if (runs < 1) runs = 1;
+        if (runs > buffers - 2) runs = buffers - 2; // keep at least one dedicated buffer
+    }
+    int dedicated = (runs == 0) ? count : (buffers - 1 - runs);
+    int spilled = count - dedicated;
+
+    printf("Level %d: fragments %d to %d, %d dedicated buffers, %d overflow runs\n",
+           depth, first, last, dedicated, runs);
+
+    // 1: Map every spilled fragment to its overflow run, and open the runs
+    int *runOf = NULL;
+    int *runFirst = NULL, *runLast = NULL;
+    TnOF *runFiles = NULL;
+    char filename[40];
+    if (runs > 0) {
+        runOf = malloc(spilled * sizeof(int));
+        runFirst = malloc(runs * sizeof(int));
+        runLast = malloc(runs * sizeof(int));
+        runFiles = malloc(runs * sizeof(TnOF));
+        for (int g = 0; g < runs; g++) {
+            runFirst[g] = first + dedicated + (g * spilled) / runs;
+            runLast[g] = first + dedicated + ((g + 1) * spilled) / runs - 1;
+            for (int h = runFirst[g]; h <= runLast[g]; h++) runOf[h - first - dedicated] = g;
+
+            sprintf(filename, "overflowRun%d_%d", depth, g);
+            open(&runFiles[g], filename, 'n');
+            runFiles[g].header.blockCapacity = MAX_RECORDS; // runs are temporary, pack them fully
+        }
+    }
+
+    // 2: One output buffer per dedicated fragment, then one per overflow run
+    int numBuffers = dedicated + runs;
+    Tblock *outputBuffers = malloc(numBuffers * sizeof(Tblock));
+    Tblock **outputs = malloc(numBuffers * sizeof(Tblock *));
+    for (int i = 0; i < numBuffers; i++) {
+        outputBuffers[i].nb_rec = 0;
+        outputs[i] = &outputBuffers[i];
+    }
+
+    // 3: Single read of the run (or of the source file at level 0)
+    FragmentWriter writer;
+    openFragmentWriter(&writer, first, first + dedicated - 1);
+    SourceReader source;
+    openSource(&source, runFile, buffers - numBuffers); // the input buffer and the outputs left unused
+    int nbBlocks = getHeader(source.file, 1);
+    setFragmentKeys(&writer, getHeader(source.file, 2) / count);
+    IOPipeline *pipe = openPipeline(&source, inFlight);
+    FragmentRouter router;
+    initRouter(&router, K);
+    int *bufferOf = malloc(count * sizeof(int)); // output buffer of each fragment of [first, last]
+    for (int h = 0; h < count; h++) bufferOf[h] = (h < dedicated) ? h : dedicated + runOf[h - dedicated];
+    int target[MAX_RECORDS], start[numBuffers + 1];
+    Record staged[MAX_RECORDS];
+
+    for (int blockNum = 1; blockNum <= nbBlocks; blockNum++) {
+        Tblock inputBuffer;
+        const Tblock *input = pipelineNext(pipe, &source, blockNum, &inputBuffer);
+        cost->blockReads++;
+
+        routeBlock(&router, input, target);
+        for (int j = 0; j < input->nb_rec; j++) {
+            int h = target[j] - first;
+            target[j] = ((unsigned)h < (unsigned)count) ? bufferOf[h] : -1;
+        }
+        scatterBlock(input->T, target, input->nb_rec, numBuffers, staged, start);
+
+        for (int b = 0; b < numBuffers; b++) {
+            int capacity = (b < dedicated) ? blockCapacity : MAX_RECORDS; // runs are packed fully
+            int r = start[b];
+            while (r < start[b + 1]) {
+                Tblock *out = outputs[b];
+                int room = capacity - out->nb_rec;
+                int take = start[b + 1] - r;
+                if (take > room) take = room;
+                memcpy(&out->T[out->nb_rec], &staged[r], take * sizeof(Record));
+                out->nb_rec += take;
+                r += take;
+                if (out->nb_rec < capacity) continue;
+
+                if (b < dedicated) {
+                    pipelineWrite(pipe, &writer, first + b, NULL, &outputs[b]);
+                } else {
+                    pipelineWrite(pipe, NULL, 0, &runFiles[b - dedicated], &outputs[b]);
+                    cost->blockWrites++;
+                }
+            }
+        }
+    }
+    free(bufferOf);
+    Tblock *pipeBlocks = closePipeline(pipe);
+    closeSource(&source);
+
+    // 4: Flush what is left in the buffers
+    for (int i = 0; i < dedicated; i++) {
+        if (outputs[i]->nb_rec > 0) {
+            fragmentWriterAppend(&writer, first + i, outputs[i]);
+        }
+    }
+    closeFragmentWriter(&writer);
+    addWriterCost(cost, &writer);
+    for (int g = 0; g < runs; g++) {
+        Tblock *runBuffer = outputs[dedicated + g];
+        if (runBuffer->nb_rec > 0) {
+            appendBlock(&runFiles[g], *runBuffer);
+            runFiles[g].header.nb_rec += runBuffer->nb_rec;
+            cost->blockWrites++;
+        }
+        close(runFiles[g]);
+    }
+    free(pipeBlocks);
+    free(outputs);
+    free(outputBuffers);
+
+    // 5: Redistribute every overflow run recursively, then drop it
+    for (int g = 0; g < runs; g++) {
+        sprintf(filename, "overflowRun%d_%d", depth, g);
+        partitionRange(filename, K, M, runFirst[g], runLast[g], blockCapacity, depth + 1, cost);
+        remove(filename);
+    }
+
+    free(runOf);
+    free(runFirst);
+    free(runLast);
+    free(runFiles);
+}
+
+
+void partitionSinglePass(const char *sourceFile, int K, int M) {
+    IOStats before = *getGlobalStats();
+    if (K < 1 || M < 3) {
+        printf("Error: A single-pass partitioning needs at least 1 fragment and 3 buffers\n");
+        return;
+    }
+    int passes = (K + M - 2) / (M - 1);  // what the multi-pass solution would need
+    printf("Partitioning into %d fragments using %d buffers (single read of the source)\n", K, M);
+
+    TnOF srcFile;
+    open(&srcFile, sourceFile, 'o');
+    if (srcFile.f == NULL) {
+        printf("Error: Could not open source file '%s'\n", sourceFile);
+        return;
+    }
+    int blockCapacity = getHeader(srcFile, 3);
+    int nbBlocks = getHeader(srcFile, 1);
+    printf("Source file: %d blocks, blockCapacity=%d\n", nbBlocks, blockCapacity);
+    close(srcFile);
+
+    if (nbBlocks == 0) {
+        printf("Error: Source file is empty!\n");
+        return;
+    }
+
+    if (fragmentLimit > 0) skewReport(sourceFile, K);
+    PartitionCost cost = {0, 0, 0, 0, 0};
+    createFragments("partition", K, blockCapacity);
+    partitionRange(sourceFile, K, M, 0, K - 1, blockCapacity, 0, &cost);
+
+    balanceFragments(K, M);
+    saveManifest(K, blockCapacity, NULL);
+    printf("\nPartitioning complete! Created %d fragment files.\n", K);
+    printPartitionCost(nbBlocks, passes, cost, &before);
+}
+
+
+
+
+//--- Grace hash join: both inputs partitioned with the same K, then one in-memory hash table per fragment pair ---//
+// A key of fragment "joinL<p>" (left input) can only match fragment "joinR<p>" (right input), negative keys included.
+// The side of a pair with fewer records is loaded into a hash table that takes at most M - 2 blocks of memory, its chain
+// links and bucket heads included; one buffer is left for the other side and one for the output. A pair whose both sides
+// are larger is partitioned again into "<fragment>_<s>" with joinRoute(), and past JOIN_MAX_LEVEL (a key repeated more
+// times than the table holds) it is joined by chunks of the table's size, each probed by the whole other side.
+
+typedef struct JoinTable
+{
+    Record *recs;       // records of the build side chunk
+    int *next;          // next record of the same bucket, -1 at the end
+    int *head;          // first record of each bucket, -1 when empty: at most one bucket per record
+    int shift;          // bucket = (key * golden ratio) >> shift: the high bits, keys of a fragment share their low ones
+    int capacity;       // records held within the M - 2 blocks
+}JoinTable;
+
+typedef struct JoinState
+{
+    int M;
+    JoinVisitor visit;
+    void *ctx;
+    TnOF output;            // output.f is NULL when the matches only go to visit
+    Tblock outBuf;
+    JoinTable table;
+    long matches;
+    long pairs;             // fragment pairs joined in memory
+    long splits;            // pairs partitioned again
+    long chunks;            // table loads of the pairs joined past JOIN_MAX_LEVEL
+    int depth;              // deepest level joined
+    long probeReads;        // fragment blocks read to build and probe
+    long outputBlocks;
+    PartitionCost splitCost; // partitioning again
+}JoinState;
+
+static void dropJoinFragment(const char *filename)
+{
+    poolDropFrom(statsOf(filename), 1);
+    remove(filename);
+    dropIndex(filename);
+    dropBloom(filename);
+}
+
+//--- Partition source into the K fragments "<prefix><p>" with M buffers, returns the passes made ---//
+static int joinPartition(const char *source, const char *prefix, int K, int level, int M, PartitionCost *cost)
+{
+    TnOF file;
+    open(&file, source, 'o');
+    int blockCapacity = getHeader(file, 3);
+    close(file);
+
+    int inFlight = asyncBuffers(M);
+    int perPass = M - 1 - inFlight;
+    int passes = (K + perPass - 1) / perPass;
+    createFragments(prefix, K, blockCapacity);
+    for (int pass = 0; pass < passes; pass++) {
+        int startFragment = pass * perPass;
+        int endFragment = startFragment + perPass - 1;
+        if (endFragment >= K) endFragment = K - 1;
+        partitionPass(source, prefix, K, level, startFragment, endFragment, blockCapacity, perPass, inFlight, cost);
+    }
+    return passes;
+}
+
+static void flushJoinOutput(JoinState *join)
+{
+    if (join->outBuf.nb_rec == 0) return;
+    appendBlock(&join->output, join->outBuf);
+    join->output.header.nb_rec += join->outBuf.nb_rec;
+    join->outputBlocks++;
+    join->outBuf.nb_rec = 0;
+}
+
+// a Record is its key: the output holds the left record of every match
+static void emitMatch(JoinState *join, const Record *left, const Record *right)
+{
+    join->matches++;
+    if (join->visit != NULL) join->visit(left, right, join->ctx);
+    if (join->output.f == NULL) return;
+    join->outBuf.T[join->outBuf.nb_rec++] = *left;
+    if (join->outBuf.nb_rec >= join->output.header.blockCapacity) flushJoinOutput(join);
+}
+
+//--- Load the build side from record (*block, *slot) on until the table is full, and move the position past them ---//
+static void buildJoinTable(JoinState *join, SourceReader *build, int nbBlocks, int *block, int *slot)
+{
+    JoinTable *table = &join->table;
+    int n = 0;
+    while (*block <= nbBlocks && n < table->capacity) {
+        Tblock buf;
+        const Tblock *in = sourceBlock(build, *block, &buf);
+        join->probeReads++;
+        int take = in->nb_rec - *slot;
+        if (take > table->capacity - n) take = table->capacity - n; // the rest of the block goes to the next load
+        memcpy(&table->recs[n], &in->T[*slot], take * sizeof(Record));
+        n += take;
+        *slot += take;
+        if (*slot >= in->nb_rec) {
+            (*block)++;
+            *slot = 0;
+        }
+    }
+
+    int bits = 1;
+    while ((2 << bits) <= n) bits++; // at most one bucket per record, chains of one or two on average
+    table->shift = 32 - bits;
+    memset(table->head, -1, (1 << bits) * sizeof(int));
+    for (int r = 0; r < n; r++) {
+        unsigned bucket = ((unsigned)table->recs[r].key * 0x9E3779B1u) >> table->shift;
+        table->next[r] = table->head[bucket];
+        table->head[bucket] = r;
+    }
+}
+
+static void splitJoinPair(JoinState *join, const char *leftName, const char *rightName, int level);
+
+//--- Join fragment leftName with fragment rightName ---//
+static void joinPair(JoinState *join, const char *leftName, const char *rightName, int level)
+{
+    SourceReader left, right;
+    openSource(&left, leftName, 1); // one block at a time: the table takes M - 2 blocks, the probe input and the output one each
+    openSource(&right, rightName, 1);
+    int leftBuilds = getHeader(left.file, 2) <= getHeader(right.file, 2);
+    SourceReader *build = leftBuilds ? &left : &right;
+    SourceReader *probe = leftBuilds ? &right : &left;
+    int buildRecords = getHeader(build->file, 2);
+    int buildBlocks = getHeader(build->file, 1);
+    int probeBlocks = getHeader(probe->file, 1);
+    JoinTable *table = &join->table;
+
+    if (buildRecords > table->capacity && level < JOIN_MAX_LEVEL) {
+        closeSource(&left);
+        closeSource(&right);
+        splitJoinPair(join, leftName, rightName, level + 1);
+        return;
+    }
+    if (buildRecords == 0) { // nothing can match
+        closeSource(&left);
+        closeSource(&right);
+        return;
+    }
+    if (level > join->depth) join->depth = level;
+    if (buildRecords <= table->capacity) join->pairs++;
+    else join->chunks += (buildRecords + table->capacity - 1) / table->capacity;
+
+    int block = 1, slot = 0;
+    while (block <= buildBlocks) {
+        buildJoinTable(join, build, buildBlocks, &block, &slot);
+
+        for (int b = 1; b <= probeBlocks; b++) {
+            Tblock buf;
+            const Tblock *probeBlock = sourceBlock(probe, b, &buf);
+            join->probeReads++;
+            for (int j = 0; j < probeBlock->nb_rec; j++) {
+                const Record *rec = &probeBlock->T[j];
+                unsigned bucket = ((unsigned)rec->key * 0x9E3779B1u) >> table->shift;
+                for (int r = table->head[bucket]; r >= 0; r = table->next[r]) {
+                    if (table->recs[r].key != rec->key) continue;
+                    if (leftBuilds) emitMatch(join, &table->recs[r], rec);
+                    else emitMatch(join, rec, &table->recs[r]);
+                }
+            }
+        }
+    }
+    closeSource(&left);
+    closeSource(&right);
+}
+
+//--- Partition both fragments again into M - 1 sub-fragments each, join the pairs, then drop them ---//
+static void splitJoinPair(JoinState *join, const char *leftName, const char *rightName, int level)
+{
+    int fragments = join->M - 1 - asyncBuffers(join->M); // a single pass over each side
+    char leftPrefix[PATH_MAX], rightPrefix[PATH_MAX], leftSub[PATH_MAX], rightSub[PATH_MAX];
+    formatName(leftPrefix, sizeof(leftPrefix), "%s_", leftName);
+    formatName(rightPrefix, sizeof(rightPrefix), "%s_", rightName);
+    join->splits++;
+    joinPartition(leftName, leftPrefix, fragments, level + 1, join->M, &join->splitCost); // pass level 1 is the inputs
+    joinPartition(rightName, rightPrefix, fragments, level + 1, join->M, &join->splitCost);
+
+    for (int s = 0; s < fragments; s++) {
+        formatName(leftSub, sizeof(leftSub), "%s%d", leftPrefix, s);
+        formatName(rightSub, sizeof(rightSub), "%s%d", rightPrefix, s);
+        joinPair(join, leftSub, rightSub, level);
+        dropJoinFragment(leftSub);
+        dropJoinFragment(rightSub);
+    }
+}
+
+long joinTnOF(const char *leftFile, const char *rightFile, int K, int M, const char *outputFile, JoinVisitor visit, void *ctx)
+{
+    IOStats before = *getGlobalStats();
+    if (K < 1 || M < 3) {
+        printf("Error: A join needs at least 1 fragment and 3 buffers\n");
+        return -1;
+    }
+    if (outputFile != NULL && (strcmp(outputFile, leftFile) == 0 || strcmp(outputFile, rightFile) == 0)) {
+        printf("Error: The join output '%s' would overwrite one of its inputs\n", outputFile);
+        return -1;
+    }
 
+    // Step 1: Both inputs must exist, their sizes give the cost model
+    const char *inputs[2] = {leftFile, rightFile};
+    int blocks[2];
+    for (int side = 0; side < 2; side++) {
+        TnOF file;
+        open(&file, inputs[side], 'o');
+        if (file.f == NULL) {
+            printf("Error: Could not open source file '%s'\n", inputs[side]);
+            return -1;
+        }
+        blocks[side] = getHeader(file, 1);
         close(file);
+    }
+    int nbBlocks = blocks[0] + blocks[1];
+    printf("Joining '%s' (%d blocks) with '%s' (%d blocks) on key, %d fragments and %d buffers\n",
+           leftFile, blocks[0], rightFile, blocks[1], K, M);
 
-        printf("Your record has been deleted successfully\n");
+    JoinState *join = calloc(1, sizeof(JoinState)); // holds a block for the output
+    join->M = M;
+    join->visit = visit;
+    join->ctx = ctx;
+    if (outputFile != NULL) {
+        TnOF left;
+        open(&left, leftFile, 'o');
+        int blockCapacity = getHeader(left, 3);
+        close(left);
+        open(&join->output, outputFile, 'n');
+        join->output.header.blockCapacity = blockCapacity; // the output has the capacity of the left input
+        if (blockEncoding == ENCODING_PACKED) startPacked(&join->output);
     }
-    else printf("Your record doesn't exist in the file\n");
-}
 
+    // Step 2: Partition phase, the fragments of both inputs with the same hash(key, K)
+    PartitionCost cost = {0, 0, 0, 0, 0};
+    int passes = joinPartition(leftFile, "joinL", K, 1, M, &cost);
+    joinPartition(rightFile, "joinR", K, 1, M, &cost);
+    printf("Partition phase: %d passes over each input\n", passes);
+    printPartitionCost(nbBlocks, passes, cost, &before);
 
+    // Step 3: Build and probe phase, one fragment pair at a time
+    IOStats probeStart = *getGlobalStats();
+    // the record, its chain link and at most one bucket head per record: (M - 2) blocks in all
+    int capacity = (int)((long)(M - 2) * sizeof(Tblock) / (sizeof(Record) + 2 * sizeof(int)));
+    int buckets = 2;
+    while (2 * buckets <= capacity) buckets *= 2;
+    join->table.capacity = capacity;
+    join->table.recs = malloc(capacity * sizeof(Record));
+    join->table.next = malloc(capacity * sizeof(int));
+    join->table.head = malloc(buckets * sizeof(int));
+    printf("\nHash table: %d records in %d buffers\n", capacity, M - 2);
 
-void displayTnOF(const char *filename){
-    TnOF file;
-    Tblock buffer;
+    char leftName[30], rightName[30];
+    for (int p = 0; p < K; p++) {
+        sprintf(leftName, "joinL%d", p);
+        sprintf(rightName, "joinR%d", p);
+        joinPair(join, leftName, rightName, 0);
+        dropJoinFragment(leftName);
+        dropJoinFragment(rightName);
+    }
+    if (join->output.f != NULL) {
+        flushJoinOutput(join);
+        close(join->output);
+    }
 
-    open(&file, filename, 'o');
-    int i=1,j,nb_blocks=getHeader(file, 1);
+    printf("\nJoin phase: %ld fragment pairs joined in memory, %ld partitioned again (depth %d), %ld nested loop chunks\n",
+           join->pairs, join->splits, join->depth, join->chunks);
+    long partitionOps = cost.blockReads + cost.blockWrites;
+    long splitOps = join->splitCost.blockReads + join->splitCost.blockWrites;
+    printf("Grace join cost model N x (passes + 1) + N = %d x %d + %d = %d block operations\n",
+           nbBlocks, passes + 1, nbBlocks, nbBlocks * (passes + 2));
+    printf("Actual cost: %ld partitioning + %ld build and probe reads + %ld partitioning again = %ld block operations\n",
+           partitionOps, join->probeReads, splitOps, partitionOps + join->probeReads + splitOps);
+    if (outputFile != NULL) printf("Output: %ld matches in %ld blocks of '%s'\n", join->matches, join->outputBlocks, outputFile);
+    else printf("Output: %ld matches\n", join->matches);
+    IOStats measured;
+    diffIOStats(getGlobalStats(), &probeStart, &measured);
+    printIOStats("Measured I/O of the join phase", &measured);
 
+    long matches = join->matches;
+    free(join->table.recs);
+    free(join->table.next);
+    free(join->table.head);
+    free(join);
+    return matches;
+}
 
-    printf("Displaying header: \n");
-    printf("\t- Number of allocated blocks: %d\n\t- Total number of records: %d\n", nb_blocks, getHeader(file, 2));
 
+//--- Streaming partitioner: records are routed as they arrive, from a key stream or the growing tail of a TnOF file ---//
 
-    while(i<=nb_blocks){
-        readBlock(file, i, &buffer);
-        printf("Displaying block: %d  nb_rec=%d\n", i,buffer.nb_rec);
+typedef struct StreamSource
+{
+    FILE *in;
+    int format;             // LOAD_TEXT, LOAD_BINARY or STREAM_TNOF
+    int follow;             // STREAM_TNOF: wait for the file to grow instead of stopping at its end
+    char buf[1 << 16];      // text and binary streams
+    int len;
+    int pos;
+    long value;             // text number split across two reads
+    int inNumber;
+    int negative;
+    int block;              // STREAM_TNOF: next record to route is (block, slot)
+    int slot;
+    Tblock tail;            // copy of that block
+}StreamSource;
 
-        j = 0;
-        while (j < buffer.nb_rec)
-        {
-            printf("\t- Key: %d\n", buffer.T[j].key); //--- Only display key (no info field) ---//
-            j++;
+//--- Next key of the stream: 1, 0 at its end, -1 if none arrived within timeoutMillis ---//
+static int streamNext(StreamSource *s, int *key, int timeoutMillis)
+{
+    if (s->format == STREAM_TNOF) {
+        while (s->slot >= s->tail.nb_rec) {
+            Header header;
+            if (sysReadAt(s->in, &header, sizeof(Header), 0) != sizeof(Header)) return 0;
+            long got = 0;
+            if (s->block <= header.nb_block) got = sysReadAt(s->in, &s->tail, sizeof(Tblock), blockOffset(s->block)); // it may have grown
+            if (got != sizeof(Tblock)) s->tail.nb_rec = 0;
+            if (s->slot < s->tail.nb_rec) break;
+            if (s->block < header.nb_block) { // appends only fill the last block: this one is done
+                s->block++;
+                s->slot = 0;
+                s->tail.nb_rec = 0; // read at the next turn
+                continue;
+            }
+            if (!s->follow) return 0;
+            struct timespec pause = {0, (timeoutMillis < 10 ? timeoutMillis : 10) * 1000000L};
+            nanosleep(&pause, NULL);
+            return -1;
         }
-        i++;
+        *key = s->tail.T[s->slot++].key;
+        return 1;
     }
-    close(file);
-}
 
+    while (1) {
+        if (s->format == LOAD_BINARY && s->len - s->pos >= (int)sizeof(int)) {
+            memcpy(key, s->buf + s->pos, sizeof(int));
+            s->pos += sizeof(int);
+            return 1;
+        }
+        if (s->format != LOAD_BINARY) {
+            while (s->pos < s->len) {
+                int c = s->buf[s->pos++];
+                if (c >= '0' && c <= '9') {
+                    s->value = s->value * 10 + (c - '0');
+                    s->inNumber = 1;
+                } else if (s->inNumber) {
+                    *key = (int)(s->negative ? -s->value : s->value);
+                    s->value = 0, s->inNumber = 0, s->negative = 0;
+                    return 1;
+                } else {
+                    s->negative = (c == '-');
+                }
+            }
+        }
+        // refill, keeping the bytes of a split binary key
+        int kept = s->len - s->pos;
+        memmove(s->buf, s->buf + s->pos, kept);
+        s->len = kept;
+        s->pos = 0;
+        long got = sysReadAvailable(s->in, s->buf + kept, sizeof(s->buf) - kept, timeoutMillis);
+        if (got < 0) return -1;
+        if (got == 0) {
+            if (s->format == LOAD_BINARY || !s->inNumber) return 0;
+            *key = (int)(s->negative ? -s->value : s->value); // last number without a separator
+            s->inNumber = 0;
+            return 1;
+        }
+        s->len += got;
+    }
+}
 
-int hash(int key , int k)
+//--- Append n records to an open fragment: its last block is topped up first, so every block but the last stays full ---//
+// A packed fragment is never rewritten: its records go to new blocks.
+static void streamAppend(TnOF *file, const Record *recs, int n)
 {
-return (key % k);
+    Tblock block;
+    int nbBlocks = getHeader(*file, 1);
+    int blockCapacity = getHeader(*file, 3);
+    int k = 0;
+    if (n == 0) return;
+    if (nbBlocks > 0 && getHeader(*file, 2) < nbBlocks * blockCapacity && file->directory == NULL) { // packed: appended only
+        readBlock(*file, nbBlocks, &block);
+        while (k < n && block.nb_rec < blockCapacity) block.T[block.nb_rec++] = recs[k++];
+        writeBlock(*file, nbBlocks, block);
+    }
+    while (k < n) {
+        block.nb_rec = (n - k < blockCapacity) ? n - k : blockCapacity;
+        memcpy(block.T, recs + k, block.nb_rec * sizeof(Record));
+        appendBlock(file, block);
+        k += block.nb_rec;
+    }
+    file->header.nb_rec += n;
 }
 
+//--- Write the header of an open file in place, after the blocks it covers: a reader opening it sees whole blocks ---//
+static void checkpointHeader(TnOF *file)
+{
+    poolFlush(file->stats);
+    STAT_ADD(file->stats, headerWrites, 1);
+    STAT_ADD(file->stats, bytesWritten, sizeof(Header));
+    if (file->map != NULL) {
+        memcpy(file->map, &(file->header), sizeof(Header));
+        return;
+    }
+    fflush(file->f); // blocks first
+    rewind(file->f);
+    STAT_ADD(file->stats, seeks, 1);
+    fwrite(&(file->header), sizeof(Header), 1, file->f);
+    fflush(file->f);
+}
 
-void partition(const char *sourceFile, int K, int M) {
-    // Step 1: Calculate number of passes needed
-    int passes = (K + M - 2) / (M - 1);  // ceiling of K/(M-1)
-    printf("Partitioning into %d fragments using %d buffers\n", K, M);
-    printf("Number of passes required: %d\n", passes);
+long streamPartition(const char *source, int format, int K, int M, float loadingFactor, int flushMillis, int idleMillis)
+{
+    if (K < 1 || M < 2) {
+        printf("Error: Streaming needs K >= 1 and M >= 2 buffers\n");
+        return -1;
+    }
+    StreamSource *s = malloc(sizeof(StreamSource));
+    s->in = (strcmp(source, "-") == 0) ? stdin : fopen(source, "rb");
+    if (s->in == NULL) {
+        printf("Error: Could not open stream '%s'\n", source);
+        free(s);
+        return -1;
+    }
+    s->format = format;
+    s->follow = (idleMillis > 0);
+    s->len = 0, s->pos = 0;
+    s->value = 0, s->inNumber = 0, s->negative = 0;
+    s->block = 1, s->slot = 0;
+    s->tail.nb_rec = 0;
 
-    // Step 2: Get blockCapacity and the nbBlocks from source file
-    TnOF srcFile;
-    open(&srcFile, sourceFile, 'o');
-    if (srcFile.f == NULL) {
-        printf("Error: Could not open source file '%s'\n", sourceFile);
-        return;
+    int blockCapacity;
+    if (format == STREAM_TNOF) { // the fragments get the capacity of the followed file
+        Header header;
+        if (sysReadAt(s->in, &header, sizeof(Header), 0) != sizeof(Header) || !validHeader(&header)) {
+            printf("Error: '%s' is not a TnOF v%d file with %d-byte blocks\n", source, TNOF_VERSION, BLOCK_SIZE);
+            fclose(s->in);
+            free(s);
+            return -1;
+        }
+        if (header.encoding == ENCODING_PACKED) { // its directory is only written when it is closed
+            printf("Error: '%s' is packed: a growing TnOF file must be raw\n", source);
+            fclose(s->in);
+            free(s);
+            return -1;
+        }
+        blockCapacity = header.blockCapacity;
+    } else {
+        if (loadingFactor <= 0.0 || loadingFactor > 1.0) loadingFactor = 0.8;
+        blockCapacity = (int)(MAX_RECORDS * loadingFactor);
+        if (blockCapacity < 1) blockCapacity = 1;
     }
-    int blockCapacity = getHeader(srcFile, 3);
-    int nbBlocks = getHeader(srcFile, 1);
-    printf("Source file: %d blocks, blockCapacity=%d\n", nbBlocks, blockCapacity);
-    close(srcFile);
-    
-    if (nbBlocks == 0) {
-        printf("Error: Source file is empty!\n");
-        return;
-    }    
 
-    // Step 3: Create K empty fragment files with same blockCapacity
+    createFragments("partition", K, blockCapacity);
+    TnOF *fragments = malloc(K * sizeof(TnOF));
     char filename[30];
-    for (int i = 0; i < K; i++) {
-        sprintf(filename, "partition%d", i);
-        TnOF fragFile;
-        open(&fragFile, filename, 'n');
-        fragFile.header.blockCapacity = blockCapacity;  // we work as if the fragmented file has the Same capacity as source
-        close(fragFile);
+    for (int p = 0; p < K; p++) {
+        sprintf(filename, "partition%d", p);
+        open(&fragments[p], filename, 'o');
     }
 
-    // Step 4: Multi-pass algorithm
-    for (int pass = 0; pass < passes; pass++) {
-        // 4a: Calculate fragment range for this pass
-        int startFragment = pass * (M - 1);
-        int endFragment = startFragment + (M - 2);
-        if (endFragment >= K) endFragment = K - 1;
-        
-        int numBuffers = endFragment - startFragment + 1;  // actual number of fragments in this pass
-        printf("\nPass %d: Processing fragments %d to %d (%d buffers)\n", pass + 1, startFragment, endFragment, numBuffers);
+    // M - 1 output buffers (one is the input): one per fragment when K <= M - 1, else a shared staging area
+    // grouped by fragment (counting sort) when it is full, so each spill appends about (M - 1) / K blocks per fragment
+    int numBuffers = M - 1;
+    int dedicated = (K <= numBuffers);
+    long capacity = (long)numBuffers * blockCapacity;
+    Record *pending = malloc(capacity * sizeof(Record));
+    int *count = calloc(K, sizeof(int));                // dedicated: records in the buffer of each fragment
+    int *target = dedicated ? NULL : malloc(capacity * sizeof(int));
+    Record *grouped = dedicated ? NULL : malloc(capacity * sizeof(Record));
+    int *start = malloc((K + 1) * sizeof(int));
+    Header *headers = malloc(K * sizeof(Header));
+    long staged = 0;                                    // shared: records in pending
 
-        // 4b: Initialize output buffers for this pass
-        Tblock outputBuffers[numBuffers];
-        for (int i = 0; i < numBuffers; i++) {
-            outputBuffers[i].nb_rec = 0;
-        }
+    long total = 0, skipped = 0, flushes = 0;
+    int checkpoints = 0;
+    long interval = (long)flushMillis * 1000000L;
+    long now = nanosNow();
+    long nextCheckpoint = now + interval, lastRecord = now;
+    printf("Streaming %s into %d fragments with %d buffers (%s)\n", source, K, M,
+           dedicated ? "one buffer per fragment" : "shared buffers");
 
-        // 4c: Open source file and read all blocks
-        open(&srcFile, sourceFile, 'o');
-        
-        for (int blockNum = 1; blockNum <= nbBlocks; blockNum++) {
-            Tblock inputBuffer;
-            readBlock(srcFile, blockNum, &inputBuffer);
-
-            // 4d: Process each record in the block
-            for (int j = 0; j < inputBuffer.nb_rec; j++) {
-                Record rec = inputBuffer.T[j];
-                int hashValue = hash(rec.key, K);
-
-                // Check if this record belongs to current pass
-                if (hashValue >= startFragment && hashValue <= endFragment) {
-                    int bufferIndex = hashValue - startFragment;
-
-                    // Add record to the appropriate output buffer
-                    outputBuffers[bufferIndex].T[outputBuffers[bufferIndex].nb_rec] = rec;
-                    outputBuffers[bufferIndex].nb_rec++;
-
-                    // If buffer is full, write to fragment file
-                    if (outputBuffers[bufferIndex].nb_rec >= blockCapacity) {
-                        sprintf(filename, "partition%d", hashValue);
-                        TnOF fragFile;
-                        open(&fragFile, filename, 'o');
-                        allocateBlock(&fragFile);
-                        writeBlock(fragFile, fragFile.header.nb_block, outputBuffers[bufferIndex]);
-                        fragFile.header.nb_rec += outputBuffers[bufferIndex].nb_rec;
-                        close(fragFile);
-
-                        // Reset buffer
-                        outputBuffers[bufferIndex].nb_rec = 0;
+    while (1) {
+        now = nanosNow();
+        int timeFlush = (flushMillis > 0 && now >= nextCheckpoint);
+        int ended = 0;
+        if (!timeFlush) {
+            int key = 0; // set when got > 0
+            int wait = (flushMillis > 0) ? (int)((nextCheckpoint - now) / 1000000L) : 100;
+            if (idleMillis > 0 && wait > idleMillis) wait = idleMillis;
+            int got = streamNext(s, &key, wait < 1 ? 1 : wait);
+            int idle = (idleMillis > 0 && nanosNow() - lastRecord >= (long)idleMillis * 1000000L); // the source went quiet
+            if (got < 0 && !idle) continue;
+            if (got <= 0) ended = 1;
+            else {
+                lastRecord = nanosNow(); // data arrived, routed or not: the source is not idle
+                int p = hash(key, K);
+                if (p < 0 || key == TOMBSTONE_KEY) { // negative keys have no fragment
+                    skipped++;
+                    continue;
+                }
+                total++;
+                if (dedicated) {
+                    pending[(long)p * blockCapacity + count[p]++].key = key;
+                    if (count[p] == blockCapacity) { // size flush: a whole block
+                        streamAppend(&fragments[p], pending + (long)p * blockCapacity, count[p]);
+                        count[p] = 0;
+                        flushes++;
                     }
+                    continue;
                 }
+                pending[staged].key = key;
+                target[staged++] = p;
+                if (staged < capacity) continue;
             }
         }
-        
-        close(srcFile);
 
-        // 4e: Flush remaining non-empty buffers
-        for (int i = 0; i < numBuffers; i++) {
-            if (outputBuffers[i].nb_rec > 0) {
-                int fragIndex = startFragment + i;
-                sprintf(filename, "partition%d", fragIndex);
-                TnOF fragFile;
-                open(&fragFile, filename, 'o');
-                allocateBlock(&fragFile);
-                writeBlock(fragFile, fragFile.header.nb_block, outputBuffers[i]);
-                fragFile.header.nb_rec += outputBuffers[i].nb_rec;
-                close(fragFile);
+        // spill: the staging area is full, a checkpoint is due, or the stream ended
+        if (dedicated) {
+            for (int q = 0; q < K; q++) {
+                if (count[q] == 0) continue;
+                streamAppend(&fragments[q], pending + (long)q * blockCapacity, count[q]);
+                count[q] = 0;
+                flushes++;
             }
+        } else if (staged > 0) {
+            scatterBlock(pending, target, staged, K, grouped, start);
+            for (int q = 0; q < K; q++) {
+                if (start[q + 1] == start[q]) continue;
+                streamAppend(&fragments[q], grouped + start[q], start[q + 1] - start[q]);
+                flushes++;
+            }
+            staged = 0;
+        }
+        if (ended) break;
+        if (timeFlush) { // headers and manifest made consistent with the blocks written so far
+            for (int q = 0; q < K; q++) {
+                checkpointHeader(&fragments[q]);
+                headers[q] = fragments[q].header;
+            }
+            writeManifest(K, blockCapacity, headers, NULL);
+            checkpoints++;
+            nextCheckpoint = now + interval;
         }
     }
 
-    printf("\nPartitioning complete! Created %d fragment files.\n", K);
+    for (int q = 0; q < K; q++) {
+        headers[q] = fragments[q].header;
+        close(fragments[q]);
+    }
+    balanceFragments(K, M); // hot fragments are only split once the stream is over
+    if (fragmentLimit > 0) saveManifest(K, blockCapacity, NULL);
+    else writeManifest(K, blockCapacity, headers, NULL);
+    if (s->in != stdin) fclose(s->in);
+    free(s);
+    free(fragments);
+    free(pending);
+    free(count);
+    free(target);
+    free(grouped);
+    free(start);
+    free(headers);
+    printf("Streamed %ld records into %d fragments: %ld buffer flushes, %d checkpoints", total, K, flushes, checkpoints);
+    if (skipped > 0) printf(", %ld negative keys skipped", skipped);
+    printf("\n");
+    return total;
 }
 
 
-
-
 void searchPartitioned(const int key, int K, int *found, int *i, int *j) {
-    // Step 1: Calculate which partition this key belongs to using hash
-    int partitionNum = hash(key, K);
+    // Step 1: Calculate which partition this key belongs to, after the splits of the handle
+    LinearHashing lh;
+    loadRouting(K, &lh);
+    int partitionNum = linearPartition(&lh, key);
+    if (partitionNum < 0) {
+        *found = 0, *i = 0, *j = 0;
+        printf("Error: Key %d is negative and has no partition\n", key);
+        return;
+    }
     
-    // Step 2: Generate the partition filename
-    char filename[30];
-    sprintf(filename, "partition%d", partitionNum);
+    // Step 2: Generate the partition filename (its sub-fragment if it was split)
+    char filename[48];
+    routedName(filename, sizeof(filename), key, partitionNum);
     
     // Step 3: Search within that specific partition
     searchTnOF(key, filename, found, i, j);
@@ -406,12 +4948,18 @@ void searchPartitioned(const int key, int K, int *found, int *i, int *j) {
 }
 
 void insertPartitioned(Record record, int K) {
-    // Step 1: Calculate which partition this record belongs to
-    int partitionNum = hash(record.key, K);
+    // Step 1: Calculate which partition this record belongs to, after the splits of the handle
+    LinearHashing lh;
+    loadRouting(K, &lh);
+    int partitionNum = linearPartition(&lh, record.key);
+    if (partitionNum < 0) {
+        printf("Error: Key %d is negative and has no partition\n", record.key);
+        return;
+    }
     
-    // Step 2: Generate the partition filename
-    char filename[30];
-    sprintf(filename, "partition%d", partitionNum);
+    // Step 2: Generate the partition filename (its sub-fragment if it was split)
+    char filename[48];
+    routedName(filename, sizeof(filename), record.key, partitionNum);
     
     // Step 3: Check if partition file exists and is accessible
     TnOF testFile;
@@ -427,13 +4975,128 @@ void insertPartitioned(Record record, int K) {
     inserTnOF(filename, record);
 }
 
+//--- Batch of fragment p: one batch per sub-fragment when it is split ---//
+static void insertFragmentBatch(int p, const Record *recs, size_t n)
+{
+    char filename[30], name[48];
+    sprintf(filename, "partition%d", p);
+    int subs = subFragmentsOf(filename);
+    if (subs == 0) {
+        insertBatchTnOF(filename, recs, n);
+        return;
+    }
+    Record *group = malloc(n * sizeof(Record));
+    for (int sub = 0; sub < subs; sub++) {
+        size_t count = 0;
+        for (size_t r = 0; r < n; r++) {
+            if (subFragmentOf(recs[r].key, subs) == sub) group[count++] = recs[r];
+        }
+        if (count == 0) continue;
+        subFragmentName(name, sizeof(name), filename, sub);
+        insertBatchTnOF(name, group, count);
+    }
+    free(group);
+}
+
+static void deleteFragmentBatch(int p, const int *keys, size_t n)
+{
+    char filename[30], name[48];
+    sprintf(filename, "partition%d", p);
+    int subs = subFragmentsOf(filename);
+    if (subs == 0) {
+        deleteBatchTnOF(filename, keys, n);
+        return;
+    }
+    int *group = malloc(n * sizeof(int));
+    for (int sub = 0; sub < subs; sub++) {
+        size_t count = 0;
+        for (size_t k = 0; k < n; k++) {
+            if (subFragmentOf(keys[k], subs) == sub) group[count++] = keys[k];
+        }
+        if (count == 0) continue;
+        subFragmentName(name, sizeof(name), filename, sub);
+        deleteBatchTnOF(name, group, count);
+    }
+    free(group);
+}
+
+void insertPartitionedBatch(const Record *recs, size_t n, int K) {
+    // Step 1: Counting sort of the records by fragment, after the splits of the handle
+    LinearHashing lh;
+    loadRouting(K, &lh);
+    size_t *start = calloc(K + 1, sizeof(size_t));
+    size_t skipped = 0;
+    for (size_t r = 0; r < n; r++) {
+        if (recs[r].key < 0) skipped++; // negative keys have no fragment
+        else start[linearPartition(&lh, recs[r].key) + 1]++;
+    }
+    for (int p = 0; p < K; p++) start[p + 1] += start[p];
+
+    Record *grouped = malloc(n * sizeof(Record));
+    size_t *next = malloc(K * sizeof(size_t));
+    for (int p = 0; p < K; p++) next[p] = start[p];
+    for (size_t r = 0; r < n; r++) {
+        if (recs[r].key >= 0) grouped[next[linearPartition(&lh, recs[r].key)]++] = recs[r];
+    }
+
+    // Step 2: One batch per fragment that received records
+    for (int p = 0; p < K; p++) {
+        if (start[p + 1] == start[p]) continue;
+        insertFragmentBatch(p, grouped + start[p], start[p + 1] - start[p]);
+    }
+    printf("Inserted %zu records into the partitioned file", n - skipped);
+    if (skipped > 0) printf(", %zu negative keys skipped", skipped);
+    printf("\n");
+
+    free(start);
+    free(next);
+    free(grouped);
+}
+
+void deletePartitionedBatch(const int *keys, size_t n, int K) {
+    // Step 1: Counting sort of the keys by fragment, after the splits of the handle
+    LinearHashing lh;
+    loadRouting(K, &lh);
+    size_t *start = calloc(K + 1, sizeof(size_t));
+    size_t skipped = 0;
+    for (size_t k = 0; k < n; k++) {
+        if (keys[k] < 0) skipped++; // negative keys have no fragment
+        else start[linearPartition(&lh, keys[k]) + 1]++;
+    }
+    for (int p = 0; p < K; p++) start[p + 1] += start[p];
+    if (skipped > 0) printf("%zu negative keys skipped\n", skipped);
+
+    int *grouped = malloc(n * sizeof(int));
+    size_t *next = malloc(K * sizeof(size_t));
+    for (int p = 0; p < K; p++) next[p] = start[p];
+    for (size_t k = 0; k < n; k++) {
+        if (keys[k] >= 0) grouped[next[linearPartition(&lh, keys[k])]++] = keys[k];
+    }
+
+    // Step 2: One compaction pass per fragment that has keys to delete
+    for (int p = 0; p < K; p++) {
+        if (start[p + 1] == start[p]) continue;
+        deleteFragmentBatch(p, grouped + start[p], start[p + 1] - start[p]);
+    }
+
+    free(start);
+    free(next);
+    free(grouped);
+}
+
 void deletePartitioned(int key, int K) {
-    // Step 1: Calculate which partition this key belongs to
-    int partitionNum = hash(key, K);
+    // Step 1: Calculate which partition this key belongs to, after the splits of the handle
+    LinearHashing lh;
+    loadRouting(K, &lh);
+    int partitionNum = linearPartition(&lh, key);
+    if (partitionNum < 0) {
+        printf("Error: Key %d is negative and has no partition\n", key);
+        return;
+    }
     
-    // Step 2: Generate the partition filename
-    char filename[30];
-    sprintf(filename, "partition%d", partitionNum);
+    // Step 2: Generate the partition filename (its sub-fragment if it was split)
+    char filename[48];
+    routedName(filename, sizeof(filename), key, partitionNum);
     
     // Step 3: Check if partition file exists
     TnOF testFile;
@@ -446,5 +5109,466 @@ void deletePartitioned(int key, int K) {
     
     // Step 4: Delete the record from the appropriate partition
     printf("Deleting from partition %d...\n", partitionNum);
-    deleteTnOFphy(filename, key);
+    if (tombstoneDeletes) deleteTnOFlog(filename, key);
+    else deleteTnOFphy(filename, key);
+}
+
+
+//--- Sorted fragments: a file sorted in memory when it fits in M buffers, else runs of M blocks merged M - 1 at a time ---//
+
+static void emitSorted(TnOF *out, Tblock *buf, int block, int append)
+{
+    if (append) {
+        appendBlock(out, *buf);
+        out->header.nb_rec += buf->nb_rec;
+    }
+    else writeBlock(*out, block, *buf);
+    buf->nb_rec = 0;
+}
+
+//--- Merge count sorted runs (one input buffer each) into out: appended to a new run, or written over blocks 1.. of the file ---//
+static int mergeRuns(TnOF *runs, int count, TnOF *out, int append)
+{
+    Tblock *inputs = malloc(count * sizeof(Tblock));
+    int *block = malloc(count * sizeof(int));
+    int *slot = malloc(count * sizeof(int));
+    Tblock output;
+    output.nb_rec = 0;
+    int blockCapacity = getHeader(*out, 3);
+    int written = 0;
+    for (int r = 0; r < count; r++) {
+        block[r] = 1;
+        slot[r] = 0;
+        readBlock(runs[r], 1, &inputs[r]);
+    }
+    while (1) {
+        int min = -1;
+        for (int r = 0; r < count; r++) { // at most M - 1 heads: a linear scan is enough
+            if (slot[r] < inputs[r].nb_rec && (min < 0 || inputs[r].T[slot[r]].key < inputs[min].T[slot[min]].key)) min = r;
+        }
+        if (min < 0) break;
+        output.T[output.nb_rec++] = inputs[min].T[slot[min]++];
+        if (slot[min] == inputs[min].nb_rec && block[min] < getHeader(runs[min], 1)) {
+            readBlock(runs[min], ++block[min], &inputs[min]);
+            slot[min] = 0;
+        }
+        if (output.nb_rec == blockCapacity) emitSorted(out, &output, ++written, append);
+    }
+    if (output.nb_rec > 0) emitSorted(out, &output, ++written, append);
+    free(inputs);
+    free(block);
+    free(slot);
+    return written;
+}
+
+static void sortRunName(char *dst, int level, int r)
+{
+    sprintf(dst, "sortRun%d_%d", level, r);
+}
+
+void sortTnOF(const char *filename, int M)
+{
+    TnOF file;
+    open(&file, filename, 'o');
+    if (file.f == NULL) {
+        printf("Error: Could not open file '%s'\n", filename);
+        return;
+    }
+    if (M < 3) {
+        printf("Error: Sorting needs at least 3 buffers\n");
+        close(file);
+        return;
+    }
+    if (refusePacked(&file)) {
+        close(file);
+        return;
+    }
+    int nbBlocks = getHeader(file, 1);
+    int blockCapacity = getHeader(file, 3);
+    Record *chunk = malloc((long)M * MAX_RECORDS * sizeof(Record)); // the M buffers
+    Tblock buffer;
+    int written = 0, runs = 0, passes = 0;
+    long records = 0;
+    char name[40];
+
+    // 1: Sort M blocks at a time in memory: the whole file, or one run each
+    for (int first = 1; first <= nbBlocks; first += M) {
+        long count = 0;
+        for (int i = first; i < first + M && i <= nbBlocks; i++) {
+            const Tblock *block = peekBlock(file, i, &buffer);
+            for (int j = 0; j < block->nb_rec; j++) {
+                if (block->T[j].key != TOMBSTONE_KEY) chunk[count++] = block->T[j]; // tombstones are reclaimed
+            }
+        }
+        records += count;
+        qsort(chunk, count, sizeof(Record), compareRecords);
+
+        TnOF run;
+        TnOF *out = &file;
+        if (nbBlocks > M) {
+            sortRunName(name, 0, runs++);
+            open(&run, name, 'n');
+            run.header.blockCapacity = blockCapacity;
+            out = &run;
+        }
+        for (long p = 0; p < count; p += blockCapacity) {
+            buffer.nb_rec = (count - p < blockCapacity) ? (int)(count - p) : blockCapacity;
+            memcpy(buffer.T, chunk + p, buffer.nb_rec * sizeof(Record));
+            emitSorted(out, &buffer, ++written, out != &file);
+        }
+        if (out != &file) close(run);
+    }
+    free(chunk);
+
+    // 2: Merge passes of M - 1 runs into one, the last one writes the file over its own blocks
+    TnOF *inputs = malloc(M * sizeof(TnOF));
+    for (int level = 0; runs > 0; level++) {
+        int groups = (runs + M - 2) / (M - 1);
+        for (int g = 0; g < groups; g++) {
+            int count = 0;
+            for (int r = g * (M - 1); r < runs && r < (g + 1) * (M - 1); r++) {
+                sortRunName(name, level, r);
+                open(&inputs[count++], name, 'o');
+            }
+            if (groups == 1) written = mergeRuns(inputs, count, &file, 0);
+            else {
+                TnOF run;
+                sortRunName(name, level + 1, g);
+                open(&run, name, 'n');
+                run.header.blockCapacity = blockCapacity;
+                mergeRuns(inputs, count, &run, 1);
+                close(run);
+            }
+            for (int r = 0; r < count; r++) {
+                close(inputs[r]);
+                sortRunName(name, level, g * (M - 1) + r);
+                remove(name);
+            }
+        }
+        passes++;
+        runs = (groups == 1) ? 0 : groups;
+    }
+    free(inputs);
+
+    // 3: Every block but the last is now full; a file that was not dense may have shrunk
+    file.header.nb_block = written;
+    file.header.nb_rec = records;
+    file.header.tombstones = 0;
+    file.header.sorted = 1;
+    poolDropFrom(file.stats, written + 1);
+    if (file.map == NULL) sysResize(file.f, blockOffset(written + 1)); // close() truncates mapped files
+    close(file);
+    dropIndex(filename); // positions now move on every insert and delete
+    dropBloom(filename);
+    printf("%s sorted: %d records in %d blocks, %d merge passes\n", filename, getHeader(file, 2), written, passes);
+}
+
+void sortPartitions(int K, int M)
+{
+    char filename[30];
+    int blockCapacity = 0;
+    for (int p = 0; p < K; p++) {
+        sprintf(filename, "partition%d", p);
+        TnOF fragFile;
+        open(&fragFile, filename, 'o');
+        if (fragFile.f == NULL) {
+            printf("Error: Partition %d does not exist. Please partition the file first.\n", p);
+            return;
+        }
+        blockCapacity = getHeader(fragFile, 3);
+        int subs = fragFile.header.subFragments;
+        close(fragFile);
+        if (subs == 0) sortTnOF(filename, M);
+        for (int sub = 0; sub < subs; sub++) {
+            char name[48];
+            subFragmentName(name, sizeof(name), filename, sub);
+            sortTnOF(name, M);
+        }
+    }
+    LinearHashing lh;
+    loadLinearState(K, &lh); // splits keep the order of a fragment: the table stays sorted
+    saveManifest(K, blockCapacity, &lh);
+}
+
+long compactPartitions(int K)
+{
+    char filename[30];
+    long reclaimed = 0;
+    int blockCapacity = 0;
+    for (int p = 0; p < K; p++) {
+        sprintf(filename, "partition%d", p);
+        TnOF fragFile;
+        open(&fragFile, filename, 'o');
+        if (fragFile.f == NULL) {
+            printf("Error: Partition %d does not exist. Please partition the file first.\n", p);
+            return -1;
+        }
+        blockCapacity = getHeader(fragFile, 3);
+        int subs = fragFile.header.subFragments;
+        close(fragFile);
+        if (subs == 0) reclaimed += compactTnOF(filename);
+        for (int sub = 0; sub < subs; sub++) {
+            char name[48];
+            subFragmentName(name, sizeof(name), filename, sub);
+            reclaimed += compactTnOF(name);
+        }
+    }
+    LinearHashing lh;
+    loadLinearState(K, &lh);
+    saveManifest(K, blockCapacity, &lh); // the block counts of the fragments went down
+    return reclaimed;
+}
+
+
+//--- Partitioned table handle: the K fragments stay open, their headers are written back on close ---//
+int openPartitioned(PartitionedTnOF *table)
+{
+    table->K = 0;
+    table->fragments = NULL;
+    table->subFragments = NULL;
+    FILE *f = fopen(MANIFEST_FILE, "rb");
+    if (f == NULL) {
+        printf("Error: No manifest '%s'. Please partition the file first.\n", MANIFEST_FILE);
+        return 0;
+    }
+    int K, blockCapacity;
+    if (fread(&K, sizeof(int), 1, f) != 1 || fread(&blockCapacity, sizeof(int), 1, f) != 1 || K <= 0) {
+        printf("Error: Corrupted manifest '%s'\n", MANIFEST_FILE);
+        fclose(f);
+        return 0;
+    }
+    Header *headers = malloc(K * sizeof(Header));
+    int complete = fread(headers, sizeof(Header), K, f) == (size_t)K;
+    readLinearState(f, K, &table->lh);
+    fclose(f);
+
+    table->fragments = malloc(K * sizeof(TnOF));
+    table->subFragments = calloc(K, sizeof(TnOF *));
+    char filename[30], name[48];
+    int opened = 0;
+    for (int p = 0; p < K && complete; p++, opened = p) {
+        sprintf(filename, "partition%d", p);
+        open(&table->fragments[p], filename, 'o');
+        if (table->fragments[p].f == NULL) {
+            printf("Error: Partition %d does not exist. Please partition the file first.\n", p);
+            complete = 0;
+            break;
+        }
+        // the fragment header wins: the filename operations do not update the manifest
+        if (memcmp(&headers[p], &table->fragments[p].header, sizeof(Header)) != 0) {
+            printf("Partition %d changed since the manifest was written, using its header\n", p);
+        }
+        int subs = table->fragments[p].header.subFragments;
+        if (subs == 0) continue;
+        table->subFragments[p] = malloc(subs * sizeof(TnOF));
+        for (int s = 0; s < subs; s++) {
+            subFragmentName(name, sizeof(name), filename, s);
+            open(&table->subFragments[p][s], name, 'o');
+            if (table->subFragments[p][s].f == NULL) {
+                printf("Error: Sub-fragment %s does not exist\n", name);
+                for (int t = 0; t < s; t++) close(table->subFragments[p][t]);
+                free(table->subFragments[p]);
+                table->subFragments[p] = NULL;
+                close(table->fragments[p]);
+                complete = 0;
+                break;
+            }
+        }
+    }
+    free(headers);
+    if (!complete) {
+        for (int q = 0; q < opened; q++) {
+            for (int s = 0; table->subFragments[q] != NULL && s < table->fragments[q].header.subFragments; s++) {
+                close(table->subFragments[q][s]);
+            }
+            free(table->subFragments[q]);
+            close(table->fragments[q]);
+        }
+        free(table->subFragments);
+        free(table->fragments);
+        table->subFragments = NULL;
+        table->fragments = NULL;
+        return 0;
+    }
+    table->K = K;
+    table->blockCapacity = blockCapacity;
+    return 1;
+}
+
+void closePartitioned(PartitionedTnOF *table)
+{
+    if (table->fragments == NULL) return;
+    Header *headers = malloc(table->K * sizeof(Header));
+    for (int p = 0; p < table->K; p++) {
+        headers[p] = table->fragments[p].header;
+        close(table->fragments[p]);
+        for (int s = 0; table->subFragments[p] != NULL && s < headers[p].subFragments; s++) {
+            close(table->subFragments[p][s]);
+        }
+        free(table->subFragments[p]);
+    }
+    writeManifest(table->K, table->blockCapacity, headers, &table->lh);
+    free(headers);
+    free(table->fragments);
+    free(table->subFragments);
+    table->fragments = NULL;
+    table->subFragments = NULL;
+    table->K = 0;
+}
+
+int partitionOf(PartitionedTnOF *table, int key)
+{
+    return linearPartition(&table->lh, key);
+}
+
+static TnOF *fragmentOf(PartitionedTnOF *table, int key)
+{
+    int p = partitionOf(table, key);
+    if (p < 0 || p >= table->K) return NULL;
+    if (table->subFragments[p] != NULL) return &table->subFragments[p][subFragmentOf(key, table->fragments[p].header.subFragments)];
+    return &table->fragments[p];
+}
+
+void setLinearHashing(PartitionedTnOF *table, int splitBlocks)
+{
+    table->lh.splitBlocks = splitBlocks > 0 ? splitBlocks : 0;
+}
+
+//--- Pack the records of source that stay towards its front, append the others to target through move; returns the moved ---//
+static int splitFile(TnOF *source, const char *filename, TnOF *target, Tblock *move, int to, int round)
+{
+    Tblock in, keep;
+    int blockCapacity = getHeader(*source, 3);
+    int nbBlocks = getHeader(*source, 1);
+    int kept = 0, moved = 0, dropped = 0;
+    keep.nb_rec = 0;
+    for (int i = 1; i <= nbBlocks; i++) {
+        readBlock(*source, i, &in);
+        for (int j = 0; j < in.nb_rec; j++) {
+            if (in.T[j].key == TOMBSTONE_KEY) { // reclaimed on the way
+                dropped++;
+                continue;
+            }
+            if (hash(in.T[j].key, 2 * round) == to) {
+                move->T[move->nb_rec++] = in.T[j];
+                moved++;
+                if (move->nb_rec == blockCapacity) {
+                    appendBlock(target, *move);
+                    move->nb_rec = 0;
+                }
+            } else {
+                keep.T[keep.nb_rec++] = in.T[j];
+                if (keep.nb_rec == blockCapacity) {
+                    writeBlock(*source, ++kept, keep); // never ahead of the block being read
+                    keep.nb_rec = 0;
+                }
+            }
+        }
+    }
+    if (keep.nb_rec > 0) writeBlock(*source, ++kept, keep);
+    source->header.nb_block = kept;
+    source->header.nb_rec -= moved + dropped;
+    source->header.tombstones = 0;
+    poolDropFrom(source->stats, kept + 1);
+    if (source->map == NULL) sysResize(source->f, blockOffset(kept + 1)); // close() truncates mapped files
+    BloomFilter *bloom = bloomOf(source);
+    if (bloom != NULL) { // moved keys stay behind as false positives until the rebuild
+        bloom->stale = 1;
+        bloom->dirty = 1;
+    }
+    forgetIndex(source);
+    dropIndex(filename); // positions changed
+    return moved;
+}
+
+//--- Split the fragment at the split pointer: its records with key % (2 * round) == split + round move to a new last fragment ---//
+// The records of a fragment split into sub-fragments are taken from each of them; the new fragment is never split.
+// A packed fragment is refused (0): the split stays at the split pointer until it is unpacked.
+static int splitFragment(PartitionedTnOF *table)
+{
+    LinearHashing *lh = &table->lh;
+    int round = lh->base << lh->level;
+    int from = lh->split, to = round + lh->split;
+    char filename[30], name[48];
+    TnOF *source = &table->fragments[from];
+    int subs = source->header.subFragments;
+    TnOF *files = (subs > 0) ? table->subFragments[from] : source;
+    for (int s = 0; s < (subs > 0 ? subs : 1); s++) {
+        if (refusePacked(&files[s])) return 0; // the records that stay are rewritten in place
+    }
+    sprintf(filename, "partition%d", to);
+    table->fragments = realloc(table->fragments, (table->K + 1) * sizeof(TnOF));
+    table->subFragments = realloc(table->subFragments, (table->K + 1) * sizeof(TnOF *));
+    table->subFragments[to] = NULL;
+    source = &table->fragments[from]; // moved by the realloc
+    files = (subs > 0) ? table->subFragments[from] : source;
+    TnOF *target = &table->fragments[to];
+    dropSubFragments(filename); // of an earlier fragment with this name
+    open(target, filename, 'n');
+    target->header.blockCapacity = getHeader(*source, 3);
+    // both keep the order of the source, but runs taken from several sub-fragments are not merged
+    target->header.sorted = (subs == 0) && source->header.sorted;
+    BloomFilter *bloom = bloomOf(&files[0]);
+    if (bloom != NULL) {
+        target->bloom = newBloom(source->header.nb_rec / 2 + 1, target->header.blockCapacity, 0, bloom->blockBits > 0);
+        target->bloom->dirty = 1;
+    }
+
+    // One pass over each file of the source: the records that stay are packed towards its front, the others appended to the target
+    Tblock move;
+    move.nb_rec = 0;
+    int moved = 0;
+    sprintf(filename, "partition%d", from);
+    for (int s = 0; s < (subs > 0 ? subs : 1); s++) {
+        if (subs > 0) subFragmentName(name, sizeof(name), filename, s);
+        else strcpy(name, filename);
+        moved += splitFile(&files[s], name, target, &move, to, round);
+    }
+    if (move.nb_rec > 0) appendBlock(target, move);
+    target->header.nb_rec = moved;
+    if (subs > 0) source->header.nb_rec = 0; // the emptied fragment file itself holds nothing
+
+    table->K++;
+    lh->split++;
+    if (lh->split == round) { // every fragment of the round is split: addresses now use key % (2 * round)
+        lh->level++;
+        lh->split = 0;
+    }
+    printf("Split partition %d into partition %d: %d records moved, %d fragments\n", from, to, moved, table->K);
+    return 1;
+}
+
+void searchPartitionedTnOF(PartitionedTnOF *table, const int key, int *found, int *i, int *j)
+{
+    TnOF *fragment = fragmentOf(table, key);
+    *found = 0, *i = 0, *j = 0;
+    if (fragment != NULL) searchOpenTnOF(fragment, key, found, i, j);
+}
+
+int insertPartitionedTnOF(PartitionedTnOF *table, Record record)
+{
+    TnOF *fragment = fragmentOf(table, record.key);
+    if (fragment == NULL || !insertOpenTnOF(fragment, record)) return 0;
+    if (table->lh.splitBlocks > 0 && getHeader(*fragment, 1) > table->lh.splitBlocks) splitFragment(table);
+    return 1;
+}
+
+int deletePartitionedTnOF(PartitionedTnOF *table, int key)
+{
+    int i, j;
+    TnOF *fragment = fragmentOf(table, key);
+    if (fragment == NULL) return 0;
+    if (tombstoneDeletes) return deleteLogicalOpen(fragment, key, &i, &j);
+    return deleteOpenTnOF(fragment, key, &i, &j);
+}
+
+long compactPartitionedTnOF(PartitionedTnOF *table)
+{
+    long reclaimed = 0;
+    for (int p = 0; p < table->K; p++) {
+        int subs = table->fragments[p].header.subFragments;
+        if (subs == 0) reclaimed += compactOpenTnOF(&table->fragments[p]);
+        for (int sub = 0; sub < subs; sub++) reclaimed += compactOpenTnOF(&table->subFragments[p][sub]);
+    }
+    return reclaimed;
 }
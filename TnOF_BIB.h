@@ -2,7 +2,60 @@
 #define _BIBLIO_TOF_H
 #include <stdio.h>
 
-#define MAX_RECORDS 50
+// on-disk format: a header page followed by blocks of BLOCK_SIZE bytes, so every block is page aligned
+#ifndef BLOCK_SIZE
+#define BLOCK_SIZE 4096     // bytes per block, a multiple of 4096 (build with -DBLOCK_SIZE=8192, 16384, ...)
+#endif
+#define MAX_RECORDS ((BLOCK_SIZE - (int)sizeof(int)) / (int)sizeof(Record))  // 1023 records in 4 KiB
+#define TNOF_MAGIC   0x464F6E54   // "TnOF"
+#define TNOF_VERSION 2
+
+// key file formats of bulkLoadTnOF()
+#define LOAD_TEXT   0   // integers separated by newlines (or any non-digit)
+#define LOAD_BINARY 1   // raw native int32
+#define LOAD_BATCH  256 // blocks appended per write
+#define STREAM_TNOF 2   // streamPartition() only: a TnOF file whose tail is followed as it grows
+
+#define TOMBSTONE_KEY (-2147483647 - 1)  // INT_MIN: key of a logically deleted slot, never a record's key
+
+// block encodings, see setBlockEncoding()
+#define ENCODING_RAW    0   // every block is a whole Tblock, updated in place
+#define ENCODING_PACKED 1   // only the records, frame of reference + bit packing; appended to, never updated
+#define PACK_LANES      8   // a packed block interleaves its keys over 8 32-bit lanes: one AVX2 (two SSE2) register per row
+
+// block probe kernels, see setProbeKernel()
+#define PROBE_AUTO   0    // best kernel supported by the CPU
+#define PROBE_SCALAR 1
+#define PROBE_SSE2   2
+#define PROBE_AVX2   3
+
+#define INDEX_EMPTY   0
+#define INDEX_USED    1
+#define INDEX_DELETED 2
+
+// I/O backends, see setBackend()
+#define BACKEND_STDIO 0   // fseek + fread/fwrite of a copy of each block
+#define BACKEND_MMAP  1   // the whole file is mapped, blocks are accessed in place
+
+// Bloom filter sidecars, see setBloomFilters()
+#define SCAN_STOP       1  // BlockVisitor results
+#define SCAN_STOP_RANGE 2
+
+#define BLOOM_OFF      0
+#define BLOOM_FRAGMENT 1    // one filter per file
+#define BLOOM_BLOCK    2    // one per file and one per block
+#define BLOOM_BITS_PER_KEY       10   // file filter, about 1% false positives with 7 hashes
+#define BLOOM_HASHES             7
+#define BLOOM_BLOCK_BITS_PER_KEY 4    // block filters, a tenth of the data size
+#define BLOOM_BLOCK_HASHES       3
+#define BLOOM_PAGE               4096 // filters are read and written back by pages of this size
+#define BLOOM_PAGE_LOADED        1
+#define BLOOM_PAGE_DIRTY         2
+
+#define MANIFEST_FILE "partitions.manifest"  // K, block capacity and the header of every fragment
+#define LINEAR_MAGIC  0x486E694C             // "LinH": the manifest ends with the linear hashing state
+#define SKEW_SAMPLE_BLOCKS 64                // blocks of the source read by the skew pre-pass, evenly spaced
+#define JOIN_MAX_LEVEL     3                 // joinTnOF(): times a fragment pair is partitioned again before a nested loop join
 
 
 typedef struct Record
@@ -16,19 +69,170 @@ typedef struct Tblock
     int nb_rec;
 }Tblock;
 
+_Static_assert(BLOCK_SIZE % 4096 == 0, "BLOCK_SIZE must be a multiple of 4096");
+_Static_assert(sizeof(Tblock) == BLOCK_SIZE, "Tblock must fill a block exactly");
+
+// packed block: key j is base + the bits bits at bit (j / PACK_LANES) * bits of lane j % PACK_LANES,
+// word w of lane l is words[w * PACK_LANES + l]; blocks follow each other without padding
+typedef struct PackedBlock
+{
+    int nb_rec;
+    int base;           // smallest key of the block
+    int bits;           // bits of key - base, 0 when every key is base
+    unsigned int words[];
+}PackedBlock;
+
+#define PACKED_MAX_SIZE ((long)sizeof(PackedBlock) + (long)((MAX_RECORDS + PACK_LANES - 1) / PACK_LANES) * PACK_LANES * (long)sizeof(unsigned int))
+
 typedef struct Header
 {
     int nb_block;
     int nb_rec;
-    int blockCapacity;   
+    int blockCapacity;  // records per block, chosen when the file is created
+    int magic;          // TNOF_MAGIC
+    int version;        // TNOF_VERSION
+    int blockSize;      // BLOCK_SIZE of the build that created the file
+    int sorted;         // keys ascending across blocks, every block but the last full: see sortTnOF()
+    int subFragments;   // > 0: emptied, its records live in "<file>_0" .. "<file>_<n-1>", see setFragmentLimit()
+    int tombstones;     // slots of nb_rec deleted logically, reclaimed by compactTnOF()
+    int encoding;       // ENCODING_RAW, or ENCODING_PACKED: the blocks, then their byte offsets at the end of the file
 }Header;
 
+typedef struct IOStats
+{
+    long blockReads;
+    long blockWrites;       // includes the empty blocks written by allocateBlock
+    long headerReads;
+    long headerWrites;
+    long seeks;             // fseek / rewind
+    long opens;             // fopen
+    long closes;            // fclose
+    long bytesRead;
+    long bytesWritten;
+    long readNanos;         // wall time spent in readBlock / peekBlock
+    long writeNanos;        // wall time spent in writeBlock / allocateBlock / appendBlock
+    long openNanos;         // wall time spent in open()
+    long closeNanos;        // wall time spent in close()
+}IOStats;
+
+typedef struct PoolStats
+{
+    int frames;             // 0 when the pool is disabled
+    long hits;
+    long misses;
+    long evictions;
+    long writeBacks;        // dirty frames written to their file
+}PoolStats;
+
+// bytes of a filter kept in BLOOM_PAGE pages: a page is read from the sidecar when first touched, written back when changed
+typedef struct BloomPages
+{
+    unsigned char *bytes;
+    long size;              // bytes
+    long offset;            // of bytes[0] in the sidecar
+    unsigned char *state;   // per page: BLOOM_PAGE_LOADED, BLOOM_PAGE_DIRTY
+}BloomPages;
+
+typedef struct BloomFilter
+{
+    long bits;              // size of the file filter, a power of two
+    int blockBits;          // size of each block filter, 0 without block filters
+    int nbBlocks;           // block filters held (may exceed nb_block)
+    int keys;               // keys the filter was sized for
+    int deletes;            // deletions since it was built (deleted keys stay in the filter)
+    int stale;              // records moved without updating it: rebuilt before the next lookup
+    int dirty;              // header or pages written back to "<file>.bloom" by close()
+    int rewrite;            // new filter: close() writes the whole sidecar
+    FILE *sidecar;          // open while the filter is loaded, NULL for a new filter
+    BloomPages filter;
+    BloomPages blockFilters;
+}BloomFilter;
+
+typedef struct IndexEntry
+{
+    int state;          // INDEX_EMPTY, INDEX_USED or INDEX_DELETED
+    int key;
+    int block;          // position of the record in the TnOF file
+    int slot;
+}IndexEntry;
+
+typedef struct HashIndex
+{
+    FILE *f;            // "<file>.idx": the three counters below, then nbSlots entries
+    int nbSlots;        // power of two, open addressing with linear probing
+    int nbEntries;      // used entries
+    int nbUsed;         // used + deleted entries (probe chains stop at empty ones)
+}HashIndex;
+
 typedef struct TnOF
 {
     FILE *f;
     Header header;
+    char *map;      // BACKEND_MMAP only: Header followed by the Tblock array, NULL otherwise
+    long mapSize;   // mapped bytes (may exceed the used blocks, the file grows by doubling)
+    IOStats *stats; // counters of this file name, see getFileStats()
+    BloomFilter *bloom; // "<file>.bloom" once loaded, NULL if the file has none
+    int bloomLoaded;
+    HashIndex index;    // "<file>.idx" once looked up, index.f is NULL if the file has none; the counters are written back by close()
+    int indexLoaded;
+    long *directory;    // ENCODING_PACKED only: offset of every block, then of the end of the blocks; NULL otherwise
+    int directorySize;  // entries allocated
+    int directoryDirty; // blocks were appended: close() writes the directory back
 }TnOF;
 
+// called for every block of a scan, concurrently from several threads; return SCAN_STOP to stop the whole scan,
+// SCAN_STOP_RANGE to skip the rest of the calling thread's range (its later blocks), 0 to go on
+typedef int (*BlockVisitor)(const Tblock *block, int i, void *ctx);
+
+// called by joinTnOF() for every pair of records with the same key, left from the first input, right from the second
+typedef void (*JoinVisitor)(const Record *left, const Record *right, void *ctx);
+
+typedef struct FragmentRouter
+{
+    int K;
+    int mask;               // K - 1 when K is a power of two, -1 otherwise
+    unsigned long long reciprocal;  // 2^64 / K rounded up, for the multiply-shift modulo
+    double inverse;         // 1 / K, for the SIMD modulo
+}FragmentRouter;
+
+typedef struct FragmentWriter
+{
+    TnOF *files;        // open handles of fragments [first, first + count - 1]
+    int first;
+    int count;
+    long flushes;       // blocks appended to the fragments
+    long ioCalls;       // stdio calls issued (fopen, fread, fseek, fwrite, fclose)
+    long bytesWritten;  // block and header bytes written
+}FragmentWriter;
+
+typedef struct PartitionCost
+{
+    long blockReads;    // blocks read from the source file and from overflow runs
+    long blockWrites;   // blocks written to fragment files and overflow runs
+    long flushes;       // output buffers flushed to fragment files
+    long ioCalls;       // stdio calls spent on fragment files
+    long bytesWritten;  // bytes written to fragment files
+}PartitionCost;
+
+// linear hashing: K = base * 2^level + split fragments, key % (base * 2^level) is its fragment unless that is below
+// split (already split this round), then it is key % (base * 2^(level + 1)). base = K, level = split = 0 is key % K
+typedef struct LinearHashing
+{
+    int base;           // fragments before the first split
+    int level;          // splits completed rounds
+    int split;          // next fragment to split
+    int splitBlocks;    // an insert that grows a fragment past this many blocks splits the next one, 0 = no splits
+}LinearHashing;
+
+typedef struct PartitionedTnOF
+{
+    int K;
+    int blockCapacity;
+    TnOF *fragments;    // open handles of partition0 .. partitionK-1, headers resident
+    TnOF **subFragments; // subFragments[p]: open sub-fragments of fragment p, NULL when it is not split
+    LinearHashing lh;   // from the manifest, kept there by closePartitioned()
+}PartitionedTnOF;
+
 // classic functions
 void open(TnOF *file, const char *filename, const char mode);
 
@@ -42,10 +246,42 @@ int writeBlock(TnOF file, int i, Tblock buf);
 
 void allocateBlock(TnOF *file); 
 
+int appendBlock(TnOF *file, Tblock buf); // write buf as a new last block (no empty block written first)
+
+int appendBlocks(TnOF *file, const Tblock *bufs, int count); // same for count blocks, with a single write
+
+const Tblock *peekBlock(TnOF file, int i, Tblock *buf); // block i in place when mapped, else read into buf
+
+void setBackend(int backend); // backend used by the next open() calls (BACKEND_STDIO or BACKEND_MMAP)
+
+int getBackend();
+
+void setDirectIO(int on); // partition passes read their source with O_DIRECT, bypassing the page cache
+
+int getDirectIO();
+
+void setAsyncIO(int buffers); // partition passes overlap reads, routing and writes with that many of their M buffers (0: off)
+
+int getAsyncIO();
+
+void setFragmentLimit(int blocks); // partitionings split the fragments over that many blocks into sub-fragments (0: off)
+
+int getFragmentLimit();
+
+void setTombstoneDeletes(int on); // deletePartitioned() and deletePartitionedTnOF() leave tombstones (0: move the last record)
+
+int getTombstoneDeletes();
+
+void setBlockEncoding(int encoding); // encoding of the files created by bulkLoadTnOF() and initialLoad() (ENCODING_RAW or ENCODING_PACKED)
+
+int getBlockEncoding();
+
 
 // classic tnof funcitons
 void initialLoad(TnOF *file); 
 
+long bulkLoadTnOF(const char *filename, const char *source, int format, float loadingFactor); // source "-" is stdin
+
 void displayTnOF(const char *file_name); 
 
 void searchTnOF(const int key, const char *filename, int *found, int *i, int *j); 
@@ -54,16 +290,161 @@ void inserTnOF(const char *filename, Record record);
 
 void deleteTnOFphy(const char *filename, int key); 
 
+void insertBatchTnOF(const char *filename, const Record *recs, size_t n); // each block written once, header once
+
+void deleteBatchTnOF(const char *filename, const int *keys, size_t n); // one compaction pass, then the file is truncated
+
+void deleteTnOFlog(const char *filename, int key); // logical deletion: the slot becomes a tombstone, a single block write
+
+long compactTnOF(const char *filename); // packs the live records in order and truncates the file, returns the slots reclaimed
+
+long packTnOF(const char *filename); // rewrites the file in ENCODING_PACKED, returns its new size in bytes (-1 on error)
+
+long unpackTnOF(const char *filename); // back to ENCODING_RAW, so that it can be updated again
+
+void sortTnOF(const char *filename, int M); // sorts the records by key within M buffers (external merge sort if larger)
+                                            // a sorted file is searched by binary search and keeps its order on insert
+
+// same operations on an already open file (the header is written back by close)
+void searchOpenTnOF(TnOF *file, const int key, int *found, int *i, int *j);
+
+int insertOpenTnOF(TnOF *file, Record record); // 0 if the record is refused (tombstone key, packed file)
+
+int deleteOpenTnOF(TnOF *file, int key, int *i, int *j); // 0 if the key is absent, else the deleted position
+
+int deleteLogicalOpen(TnOF *file, int key, int *i, int *j); // same, leaving a tombstone (physical on sorted files)
+
+int compactOpenTnOF(TnOF *file); // slots reclaimed
+
+// background compaction: a thread compacts the files given tombstones once they are a share of their slots
+// a file is only compacted while nothing else has it open; opening it waits for the compaction to end
+int startCompactor(int thresholdPercent, int intervalMillis); // 0 if already running
+
+void stopCompactor(); // waits for the compaction in progress
+
+// I/O statistics, counted for every file name and globally (thread safe)
+const IOStats *getGlobalStats();
+
+const IOStats *getFileStats(const char *filename); // NULL if the file was never opened
+
+void resetIOStats(); // global and per-file counters
+
+void setIOTiming(int on); // 0: the block paths skip the clock reads, the time counters stay at 0 (on by default)
+
+int getIOTiming();
+
+void printIOStats(const char *label, const IOStats *stats);
+
+// buffer pool: Tblock frames cached across operations, keyed by (file name, block number)
+// CLOCK eviction, dirty frames are written back on eviction, on flush and at exit. Mapped files bypass it.
+void setBufferPool(int frames); // 0 flushes and disables the pool (default)
+
+void flushBufferPool();
+
+PoolStats getPoolStats();
+
+// block probe kernels (SIMD with a scalar fallback, chosen at run time)
+int probeBlock(const Tblock *block, int key); // first slot of the block holding key, -1 if none
+
+int countInBlock(const Tblock *block, int key); // number of slots of the block holding key
+
+int setProbeKernel(int kernel); // 0 if the CPU lacks the kernel (the current one is kept); also decodes packed blocks
+
+const char *probeKernelName();
+
+// parallel scan: the blocks are split in contiguous ranges, one thread and one descriptor (pread) per range
+long scanTnOF(const char *filename, int threads, BlockVisitor visit, void *ctx); // blocks read, -1 if the file is missing
+                                                                               // with 1 thread the blocks are visited in order
+void parallelSearchTnOF(const int key, const char *filename, int threads, int *found, int *i, int *j);
+
+long countTnOF(const int key, const char *filename, int threads); // number of records with this key
+
+// hash index sidecar: optional "<file>.idx" mapping key -> (block, slot), kept in sync by insert and delete
+void buildIndex(const char *filename); // (re)builds the index of an existing file
+
+int searchIndex(const int key, const char *filename, int *found, int *i, int *j); // 0 if the file has no usable index
+
+void dropIndex(const char *filename);
+
+// Bloom filter sidecar: optional "<file>.bloom", a lookup that misses it returns without reading a data block
+void setBloomFilters(int mode); // filters built by the partition passes and bulk loads (BLOOM_OFF, BLOOM_FRAGMENT, BLOOM_BLOCK)
+
+int getBloomFilters();
+
+void buildBloom(const char *filename, int mode); // (re)builds the filter of an existing file
+
+void dropBloom(const char *filename);
+
+// fragment writer: keeps the fragment files of a pass open, headers are written once on close
+void openFragmentWriter(FragmentWriter *writer, int first, int last);
+
+void fragmentWriterAppend(FragmentWriter *writer, int fragment, Tblock *buf); // appends buf and empties it
+
+void setFragmentKeys(FragmentWriter *writer, long keys); // starts the Bloom filters of the fragments (if enabled), sized for keys
+
+void closeFragmentWriter(FragmentWriter *writer);
+
 // TP funcitons
 
 int hash(int key , int k); // Hash function
 
+void initRouter(FragmentRouter *router, int K);
+
+void routeBlock(const FragmentRouter *router, const Tblock *block, int *fragments); // fragments[j] = hash(T[j].key, K), -1 for a tombstone
+
 void partition(const char *sourceFile , int k , int M) ; // the main partitioning function  // multi pass solution
 
+void partitionSinglePass(const char *sourceFile, int K, int M); // reads the source once, spills extra fragments to overflow runs
+
+void partitionParallel(const char *sourceFile, int K, int M, int threads); // passes run on threads, M buffers shared by all threads
+
+// Grace hash join on key: both inputs partitioned into K fragments with M buffers, then one hash table per fragment pair
+// every match goes to visit (if not NULL) and to outputFile (if not NULL); returns the matches, -1 on error
+long joinTnOF(const char *leftFile, const char *rightFile, int K, int M, const char *outputFile, JoinVisitor visit, void *ctx);
+
+// routes records into the K fragments as they arrive, from a key stream (source "-" is stdin) or a growing TnOF file
+// buffers are flushed when full and every flushMillis (headers and manifest checkpointed); returns the records routed
+long streamPartition(const char *source, int format, int K, int M, float loadingFactor, int flushMillis, int idleMillis);
+                    // idleMillis > 0: stop once the source stays quiet that long (a STREAM_TNOF file is then followed)
+
+void skewReport(const char *sourceFile, int K); // expected fragment sizes from a sample of the source's blocks
+
+int subFragmentOf(int key, int n); // secondary hash: sub-fragment of key in a fragment split into n
+
+void balancePartitions(int K, int M); // splits the fragments over the limit with M buffers, prints their sizes
+
 void searchPartitioned(const int key, int K, int *found, int *i, int *j); // search for a record within the new structure
 
 void insertPartitioned(Record record, int K); //insert a record into the new structure
 
+void insertPartitionedBatch(const Record *recs, size_t n, int K); // groups the records by fragment, one batch per fragment
+
 void deletePartitioned(int key, int K); //delete a record from the new structure
 
+void deletePartitionedBatch(const int *keys, size_t n, int K); // routes the keys by fragment, one pass per fragment
+
+void sortPartitions(int K, int M); // sorts every fragment with sortTnOF(), then rewrites the manifest
+
+long compactPartitions(int K); // compacts every fragment and sub-fragment, then rewrites the manifest
+
+// partitioned table handle: K and the fragments come from the manifest, every fragment stays open until closed
+int openPartitioned(PartitionedTnOF *table); // 0 if there is no manifest or a fragment is missing
+
+void closePartitioned(PartitionedTnOF *table); // writes the headers back and rewrites the manifest
+
+void searchPartitionedTnOF(PartitionedTnOF *table, const int key, int *found, int *i, int *j);
+
+int insertPartitionedTnOF(PartitionedTnOF *table, Record record); // 0 if the key has no fragment (negative key) or is refused
+
+int deletePartitionedTnOF(PartitionedTnOF *table, int key); // 0 if the key is absent
+
+long compactPartitionedTnOF(PartitionedTnOF *table); // compacts the open fragments, returns the slots reclaimed
+
+int partitionOf(PartitionedTnOF *table, int key); // fragment of the key, -1 for negative keys
+
+void setLinearHashing(PartitionedTnOF *table, int splitBlocks); // fragments grow one split at a time (0: stop splitting)
+                                                                // the filename functions route with the state of the manifest
+
+int manifestFragments(); // K of the manifest, 0 without one
+
 #endif 
\ No newline at end of file
@@ -0,0 +1,63 @@
+#define _GNU_SOURCE // O_DIRECT
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "TnOF_SYS.h"
+
+int sysResize(FILE *f, long size)
+{
+    fflush(f);
+    return ftruncate(fileno(f), size);
+}
+
+void *sysMap(FILE *f, long size)
+{
+    fflush(f);
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(f), 0);
+    if (map == MAP_FAILED) return NULL;
+    return map;
+}
+
+void sysUnmap(void *map, long size)
+{
+    munmap(map, size);
+}
+
+long sysReadAt(FILE *f, void *buf, long size, long offset)
+{
+    return pread(fileno(f), buf, size, offset);
+}
+
+long sysWriteAt(FILE *f, const void *buf, long size, long offset)
+{
+    fflush(f);
+    return pwrite(fileno(f), buf, size, offset);
+}
+
+FILE *sysOpenDirect(const char *filename)
+{
+    int fd = openat(AT_FDCWD, filename, O_RDONLY | O_DIRECT); // EINVAL on file systems without direct I/O
+    if (fd < 0) return NULL;
+    return fdopen(fd, "rb"); // the descriptor is released by fclose, never close(): see TnOF_SYS.h
+}
+
+void *sysAlignedAlloc(long size)
+{
+    void *buf = NULL;
+    if (posix_memalign(&buf, 4096, size) != 0) return NULL;
+    return buf;
+}
+
+long sysReadAvailable(FILE *f, void *buf, long size, int timeoutMillis)
+{
+    struct pollfd p = {fileno(f), POLLIN, 0};
+    int ready = poll(&p, 1, timeoutMillis);
+    if (ready == 0 || (ready < 0 && errno == EINTR)) return -1;
+    long got = read(fileno(f), buf, size);
+    if (got < 0) return errno == EINTR ? -1 : 0;
+    return got;
+}
@@ -0,0 +1,26 @@
+#ifndef _TNOF_SYS_H
+#define _TNOF_SYS_H
+#include <stdio.h>
+
+// Thin wrappers around POSIX calls. They live in their own file because
+// <unistd.h> and <fcntl.h> declare open/close, which clash with the abstract machine.
+// For the same reason descriptors are always obtained through fopen/fileno, never open().
+
+int sysResize(FILE *f, long size); // flushes f, then sets the file size (ftruncate)
+
+void *sysMap(FILE *f, long size); // maps the first size bytes of f read/write, NULL on failure
+
+void sysUnmap(void *map, long size);
+
+long sysReadAt(FILE *f, void *buf, long size, long offset); // pread on the descriptor of f, no stdio buffering
+
+long sysWriteAt(FILE *f, const void *buf, long size, long offset); // pwrite, returns the bytes written
+
+FILE *sysOpenDirect(const char *filename); // read-only with O_DIRECT (openat + fdopen), NULL if unsupported
+
+void *sysAlignedAlloc(long size); // page-aligned buffer for O_DIRECT transfers, released with free()
+
+long sysReadAvailable(FILE *f, void *buf, long size, int timeoutMillis); // read on the descriptor of f as soon as
+                                                                         // data arrives: 0 at the end, -1 on timeout
+
+#endif
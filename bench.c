@@ -0,0 +1,351 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "TnOF_BIB.h"
+
+// Non-interactive benchmark: generates TnOF files of synthetic keys and times the TnOF and
+// partitioned operations on them. Results are written as one JSON object per line; the
+// library's own messages are sent to /dev/null.
+//
+// usage: bench [-n keys] [-q queries] [-f loadingFactor] [-d uniform|zipf|sequential|all]
+//              [-K k1,k2,...] [-M m1,m2,...] [-p poolFrames] [-D 0|1] [-b 0|1|2] [-a buffers] [-s M] [-l blocks]
+//              [-t 0|1] [-e 0|1] [-j 0|1] [-T 0|1] [-o results]
+
+#define MAX_GRID 16
+
+typedef struct BenchConfig
+{
+    long n;                 // keys per generated file
+    int queries;            // timed calls per point operation
+    float loadingFactor;
+    const char *dist;
+    int K[MAX_GRID], nbK;
+    int M[MAX_GRID], nbM;
+    int poolFrames;         // buffer pool size, 0 = no pool
+    int directIO;           // 1 = partition passes read with O_DIRECT
+    int bloom;              // BLOOM_OFF, BLOOM_FRAGMENT or BLOOM_BLOCK
+    int asyncBuffers;       // buffers of M in flight during partitioning, 0 = synchronous
+    int sortBuffers;        // fragments sorted with M buffers before the partitioned operations, 0 = unsorted
+    int fragmentLimit;      // fragments over this many blocks split into sub-fragments, 0 = never
+    int tombstones;         // 1 = deletes leave tombstones, reclaimed by a timed compaction
+    int packed;             // 1 = the file is packed before the search is timed again and partitioned
+    int join;               // 1 = a self-join of the file is timed at every point of the K x M grid
+    int ioTiming;           // 0 = the library does not time its block reads and writes
+    const char *output;
+}BenchConfig;
+
+static FILE *results;
+
+static double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int parseList(const char *arg, int *values)
+{
+    int count = 0;
+    const char *p = arg;
+    while (*p && count < MAX_GRID) {
+        values[count++] = atoi(p);
+        p = strchr(p, ',');
+        if (p == NULL) break;
+        p++;
+    }
+    return count;
+}
+
+//--- Dataset generation ---//
+
+static void generateKeys(const char *dist, Record *recs, long n)
+{
+    if (strcmp(dist, "sequential") == 0) {
+        for (long r = 0; r < n; r++) recs[r].key = (int)r;
+    } else if (strcmp(dist, "zipf") == 0) {
+        // Zipf (s = 1) over n / 10 distinct keys, sampled by binary search in the CDF
+        long distinct = n / 10 > 0 ? n / 10 : 1;
+        double *cdf = malloc(distinct * sizeof(double));
+        double sum = 0;
+        for (long v = 0; v < distinct; v++) {
+            sum += 1.0 / (v + 1);
+            cdf[v] = sum;
+        }
+        for (long r = 0; r < n; r++) {
+            double u = (double)rand() / RAND_MAX * sum;
+            long lo = 0, hi = distinct - 1;
+            while (lo < hi) {
+                long mid = (lo + hi) / 2;
+                if (cdf[mid] < u) lo = mid + 1;
+                else hi = mid;
+            }
+            recs[r].key = (int)(lo * 7919 % distinct); // spread the hot keys over the fragments
+        }
+        free(cdf);
+    } else {
+        for (long r = 0; r < n; r++) recs[r].key = rand() % (int)(2 * n);
+    }
+}
+
+static void createFile(const char *filename, float loadingFactor)
+{
+    TnOF file;
+    open(&file, filename, 'n');
+    int blockCapacity = (int)(MAX_RECORDS * loadingFactor);
+    file.header.blockCapacity = blockCapacity < 1 ? 1 : blockCapacity;
+    close(file);
+}
+
+//--- Reporting ---//
+
+static int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char *dist, const char *op, const char *params, long n, double *latencies, int count)
+{
+    double total = 0;
+    for (int q = 0; q < count; q++) total += latencies[q];
+    qsort(latencies, count, sizeof(double), compareDoubles);
+    fprintf(results, "{\"dist\":\"%s\",\"op\":\"%s\",%s\"n\":%ld,\"count\":%d,\"ops_per_s\":%.1f,"
+            "\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+            dist, op, params, n, count, count / total,
+            latencies[count / 2] * 1e6, latencies[count * 9 / 10] * 1e6,
+            latencies[count * 99 / 100] * 1e6, latencies[count - 1] * 1e6);
+    fflush(results);
+}
+
+static void reportBulk(const char *dist, const char *op, const char *params, long n, long records, double elapsed)
+{
+    fprintf(results, "{\"dist\":\"%s\",\"op\":\"%s\",%s\"n\":%ld,\"records\":%ld,\"seconds\":%.4f,\"records_per_s\":%.1f}\n",
+            dist, op, params, n, records, elapsed, records / elapsed);
+    fflush(results);
+}
+
+//--- One key distribution ---//
+
+static void benchDistribution(const BenchConfig *config, const char *dist)
+{
+    char filename[40];
+    char params[80] = "";
+    sprintf(filename, "bench_%s", dist);
+    long n = config->n;
+    int q = config->queries;
+    Record *recs = malloc(n * sizeof(Record));
+    double *latencies = malloc(q * sizeof(double));
+    int found, i, j;
+
+    // Build
+    generateKeys(dist, recs, n);
+    createFile(filename, config->loadingFactor);
+    double start = now();
+    insertBatchTnOF(filename, recs, n);
+    reportBulk(dist, "insertBatch", params, n, n, now() - start);
+    if (config->bloom != BLOOM_OFF) buildBloom(filename, config->bloom); // the fragments get theirs from partition()
+
+    // Point operations on the unpartitioned file: half present keys, half random ones
+    for (int k = 0; k < q; k++) {
+        int key = (k % 2) ? recs[rand() % n].key : rand();
+        start = now();
+        searchTnOF(key, filename, &found, &i, &j);
+        latencies[k] = now() - start;
+    }
+    report(dist, "search", params, n, latencies, q);
+
+    for (int k = 0; k < q; k++) {
+        Record rec = {rand()};
+        start = now();
+        inserTnOF(filename, rec);
+        latencies[k] = now() - start;
+    }
+    report(dist, "insert", params, n, latencies, q);
+
+    for (int k = 0; k < q; k++) {
+        int key = recs[rand() % n].key;
+        start = now();
+        if (config->tombstones) deleteTnOFlog(filename, key);
+        else deleteTnOFphy(filename, key);
+        latencies[k] = now() - start;
+    }
+    report(dist, config->tombstones ? "deleteTombstone" : "delete", params, n, latencies, q);
+    if (config->tombstones) {
+        start = now();
+        long reclaimed = compactTnOF(filename);
+        reportBulk(dist, "compact", params, n, reclaimed, now() - start);
+    }
+    if (config->packed) {
+        start = now();
+        packTnOF(filename);
+        reportBulk(dist, "pack", params, n, n, now() - start);
+        for (int k = 0; k < q; k++) {
+            int key = (k % 2) ? recs[rand() % n].key : rand();
+            start = now();
+            searchTnOF(key, filename, &found, &i, &j);
+            latencies[k] = now() - start;
+        }
+        report(dist, "searchPacked", params, n, latencies, q);
+    }
+
+    // Partitioning over the K x M grid
+    for (int a = 0; a < config->nbK; a++) {
+        for (int b = 0; b < config->nbM; b++) {
+            int K = config->K[a], M = config->M[b];
+            if (M <= 2 || M >= K) continue;
+            sprintf(params, "\"K\":%d,\"M\":%d,", K, M);
+            start = now();
+            partition(filename, K, M);
+            reportBulk(dist, "partition", params, n, n, now() - start);
+            start = now();
+            partitionSinglePass(filename, K, M);
+            reportBulk(dist, "partitionSinglePass", params, n, n, now() - start);
+            if (config->join) {
+                start = now();
+                joinTnOF(filename, filename, K, M, NULL, NULL, NULL);
+                reportBulk(dist, "join", params, n, 2 * n, now() - start); // both inputs read
+            }
+        }
+    }
+
+    // Partitioned operations, on the fragments of the last K of the grid
+    int K = config->K[config->nbK - 1];
+    sprintf(params, "\"K\":%d,", K);
+    if (config->sortBuffers > 0) {
+        start = now();
+        sortPartitions(K, config->sortBuffers);
+        reportBulk(dist, "sortPartitions", params, n, n, now() - start);
+    }
+    for (int k = 0; k < q; k++) {
+        int key = (k % 2) ? recs[rand() % n].key : rand();
+        start = now();
+        searchPartitioned(key, K, &found, &i, &j);
+        latencies[k] = now() - start;
+    }
+    report(dist, "searchPartitioned", params, n, latencies, q);
+
+    for (int k = 0; k < q; k++) {
+        Record rec = {rand()};
+        start = now();
+        insertPartitioned(rec, K);
+        latencies[k] = now() - start;
+    }
+    report(dist, "insertPartitioned", params, n, latencies, q);
+
+    for (int k = 0; k < q; k++) {
+        int key = recs[rand() % n].key;
+        start = now();
+        deletePartitioned(key, K);
+        latencies[k] = now() - start;
+    }
+    report(dist, "deletePartitioned", params, n, latencies, q);
+
+    // Same operations through the manifest handle, fragments opened once
+    PartitionedTnOF table;
+    if (openPartitioned(&table)) {
+        for (int k = 0; k < q; k++) {
+            int key = (k % 2) ? recs[rand() % n].key : rand();
+            start = now();
+            searchPartitionedTnOF(&table, key, &found, &i, &j);
+            latencies[k] = now() - start;
+        }
+        report(dist, "searchPartitionedTnOF", params, n, latencies, q);
+
+        for (int k = 0; k < q; k++) {
+            Record rec = {rand()};
+            start = now();
+            insertPartitionedTnOF(&table, rec);
+            latencies[k] = now() - start;
+        }
+        report(dist, "insertPartitionedTnOF", params, n, latencies, q);
+
+        for (int k = 0; k < q; k++) {
+            int key = recs[rand() % n].key;
+            start = now();
+            deletePartitionedTnOF(&table, key);
+            latencies[k] = now() - start;
+        }
+        report(dist, "deletePartitionedTnOF", params, n, latencies, q);
+        if (config->tombstones) {
+            start = now();
+            long reclaimed = compactPartitionedTnOF(&table);
+            reportBulk(dist, "compactPartitionedTnOF", params, n, reclaimed, now() - start);
+        }
+        closePartitioned(&table);
+    }
+
+    for (int p = 0; p < K; p++) {
+        for (int s = 0; ; s++) { // sub-fragments of a fragment split at the -l limit
+            sprintf(filename, "partition%d_%d", p, s);
+            if (remove(filename) != 0) break;
+            dropBloom(filename);
+        }
+        sprintf(filename, "partition%d", p);
+        remove(filename);
+        dropBloom(filename);
+    }
+    remove(MANIFEST_FILE);
+    sprintf(filename, "bench_%s", dist);
+    remove(filename);
+    dropBloom(filename);
+    free(recs);
+    free(latencies);
+}
+
+int main(int argc, char **argv)
+{
+    BenchConfig config = {1000000, 100, 0.8, "all", {16, 64, 256}, 3, {4, 16, 64}, 3, 0, 0, BLOOM_OFF, 0, 0, 0, 0, 0, 0, 1, "bench_output.txt"};
+    for (int a = 1; a + 1 < argc; a += 2) {
+        if (strcmp(argv[a], "-n") == 0) config.n = atol(argv[a + 1]);
+        else if (strcmp(argv[a], "-q") == 0) config.queries = atoi(argv[a + 1]);
+        else if (strcmp(argv[a], "-f") == 0) config.loadingFactor = atof(argv[a + 1]);
+        else if (strcmp(argv[a], "-d") == 0) config.dist = argv[a + 1];
+        else if (strcmp(argv[a], "-K") == 0) config.nbK = parseList(argv[a + 1], config.K);
+        else if (strcmp(argv[a], "-M") == 0) config.nbM = parseList(argv[a + 1], config.M);
+        else if (strcmp(argv[a], "-p") == 0) config.poolFrames = atoi(argv[a + 1]);
+        else if (strcmp(argv[a], "-D") == 0) config.directIO = atoi(argv[a + 1]);
+        else if (strcmp(argv[a], "-b") == 0) config.bloom = atoi(argv[a + 1]);
+        else if (strcmp(argv[a], "-a") == 0) config.asyncBuffers = atoi(argv[a + 1]);
+        else if (strcmp(argv[a], "-s") == 0) config.sortBuffers = atoi(argv[a + 1]);
+        else if (strcmp(argv[a], "-l") == 0) config.fragmentLimit = atoi(argv[a + 1]);
+        else if (strcmp(argv[a], "-t") == 0) config.tombstones = atoi(argv[a + 1]);
+        else if (strcmp(argv[a], "-e") == 0) config.packed = atoi(argv[a + 1]);
+        else if (strcmp(argv[a], "-j") == 0) config.join = atoi(argv[a + 1]);
+        else if (strcmp(argv[a], "-T") == 0) config.ioTiming = atoi(argv[a + 1]);
+        else if (strcmp(argv[a], "-o") == 0) config.output = argv[a + 1];
+        else {
+            fprintf(stderr, "unknown option %s\n", argv[a]);
+            return 1;
+        }
+    }
+    if (config.n < 1 || config.queries < 1 || config.nbK < 1 || config.nbM < 1) {
+        fprintf(stderr, "invalid configuration\n");
+        return 1;
+    }
+
+    results = fopen(config.output, "w");
+    if (results == NULL) {
+        fprintf(stderr, "cannot write %s\n", config.output);
+        return 1;
+    }
+    freopen("/dev/null", "w", stdout); // silence the library
+    setBufferPool(config.poolFrames);
+    setDirectIO(config.directIO);
+    setBloomFilters(config.bloom);
+    setAsyncIO(config.asyncBuffers);
+    setFragmentLimit(config.fragmentLimit);
+    setTombstoneDeletes(config.tombstones);
+    setIOTiming(config.ioTiming);
+    srand(12345);
+
+    const char *dists[] = {"uniform", "zipf", "sequential"};
+    for (int d = 0; d < 3; d++) {
+        if (strcmp(config.dist, "all") == 0 || strcmp(config.dist, dists[d]) == 0) {
+            fprintf(stderr, "bench: %s, %ld keys\n", dists[d], config.n);
+            benchDistribution(&config, dists[d]);
+        }
+    }
+    fclose(results);
+    return 0;
+}
@@ -16,13 +16,61 @@ void printMenu() {
     printf("9. Search in the partitioned file\n");
     printf("10. Insert into the partitioned file\n");
     printf("11. Delete from the partitioned file\n");
-    printf("12. Exit\n");
+    printf("12. Switch I/O backend (stdio / mmap)\n");
+    printf("13. Build the hash index of the file\n");
+    printf("14. Parallel search and count of a key\n");
+    printf("15. Display I/O statistics\n");
+    printf("16. Bulk load the file from a key file\n");
+    printf("17. Configure the buffer pool\n");
+    printf("18. Work on the partitioned file (manifest)\n");
+    printf("19. Toggle direct I/O for partitioning (O_DIRECT)\n");
+    printf("20. Bloom filters (build for the file, or for partitions and bulk loads)\n");
+    printf("21. Configure asynchronous I/O for partitioning\n");
+    printf("22. Sort the file or the partitions (binary search)\n");
+    printf("23. Stream partition (key stream, named pipe or growing TnOF file)\n");
+    printf("24. Fragment skew (report, size limit, split hot fragments)\n");
+    printf("25. Tombstone deletes and compaction\n");
+    printf("26. Block encoding (pack or unpack the file, encoding of new files)\n");
+    printf("27. Join the file with another file on key (Grace hash join)\n");
+    printf("0. Exit\n");
     printf("================================================\n");
     printf("Enter your choice: ");
 }
 
-int main()
+//--- Non-interactive mode: TnOF load <file> <keys file | -> [text | binary] [loading factor] [raw | packed] ---//
+//---                       TnOF stream <keys file | - | TnOF file> <K> <M> [text | binary | tnof] [flush ms] [idle ms] [loading factor] ---//
+//---                       TnOF join <left file> <right file> <K> <M> [output file] ---//
+static int runCommand(int argc, char **argv)
 {
+    if (argc >= 4 && strcmp(argv[1], "load") == 0) {
+        int format = (argc >= 5 && strcmp(argv[4], "binary") == 0) ? LOAD_BINARY : LOAD_TEXT;
+        float loadingFactor = (argc >= 6) ? atof(argv[5]) : 0.8;
+        if (argc >= 7 && strcmp(argv[6], "packed") == 0) setBlockEncoding(ENCODING_PACKED);
+        return bulkLoadTnOF(argv[2], argv[3], format, loadingFactor) < 0;
+    }
+    if (argc >= 5 && strcmp(argv[1], "stream") == 0) {
+        int format = LOAD_TEXT;
+        if (argc >= 6 && strcmp(argv[5], "binary") == 0) format = LOAD_BINARY;
+        if (argc >= 6 && strcmp(argv[5], "tnof") == 0) format = STREAM_TNOF;
+        int flushMillis = (argc >= 7) ? atoi(argv[6]) : 1000;
+        int idleMillis = (argc >= 8) ? atoi(argv[7]) : 0;
+        float loadingFactor = (argc >= 9) ? atof(argv[8]) : 0.8;
+        return streamPartition(argv[2], format, atoi(argv[3]), atoi(argv[4]), loadingFactor, flushMillis, idleMillis) < 0;
+    }
+    if (argc >= 6 && strcmp(argv[1], "join") == 0) {
+        const char *output = (argc >= 7) ? argv[6] : NULL;
+        return joinTnOF(argv[2], argv[3], atoi(argv[4]), atoi(argv[5]), output, NULL, NULL) < 0;
+    }
+    printf("Usage: %s load <file> <keys file | -> [text | binary] [loading factor] [raw | packed]\n", argv[0]);
+    printf("       %s stream <keys file | - | TnOF file> <K> <M> [text | binary | tnof] [flush ms] [idle ms] [loading factor]\n", argv[0]);
+    printf("       %s join <left file> <right file> <K> <M> [output file]\n", argv[0]);
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1) return runCommand(argc, argv);
+
     TnOF file;
     char file_name[50];
     int choice, key, found, i, j;
@@ -30,7 +78,7 @@ int main()
     Record rec;
 
     printf("Enter the file name to work with: ");
-    scanf("%s", file_name);
+    scanf("%49s", file_name);
     getchar();
 
     do {
@@ -101,9 +149,25 @@ int main()
                 
                 if (M <= 2 || M >= K) {
                     printf("Invalid M! Must be 2 < M < K (so M can be 3 to %d)\n", K-1);
-                } else {
-                    partition(file_name, K, M);
+                    break;
+                }
+
+                int mode;
+                printf("Mode (1 = multi-pass, 2 = single pass with overflow runs, 3 = parallel multi-pass): ");
+                scanf("%d", &mode);
+                getchar();
+
+                if (mode == 2)
+                    partitionSinglePass(file_name, K, M);
+                else if (mode == 3) {
+                    int threads;
+                    printf("Number of threads (at most %d with %d buffers): ", M / 2, M);
+                    scanf("%d", &threads);
+                    getchar();
+                    partitionParallel(file_name, K, M, threads);
                 }
+                else
+                    partition(file_name, K, M);
                 break;
 
             case 7: // Display single partition
@@ -120,9 +184,13 @@ int main()
 
             case 8: // Display all partitions
                 printf("\n--- DISPLAY ALL PARTITIONS ---\n");
-                printf("Enter K (number of partitions): ");
-                scanf("%d", &K);
-                getchar();
+                K = manifestFragments(); // after the splits of the handle, the manifest has the current K
+                if (K > 0) printf("Partitions in the manifest: %d\n", K);
+                else {
+                    printf("Enter K (number of partitions): ");
+                    scanf("%d", &K);
+                    getchar();
+                }
                 
                 for (int p = 0; p < K; p++) {
                     printf("\n========== PARTITION %d ==========\n", p);
@@ -134,9 +202,13 @@ int main()
 
             case 9: // Search in the partitioned file
                 printf("\n--- SEARCH IN PARTITIONED FILE ---\n");
-                printf("Enter K (number of partitions used): ");
-                scanf("%d", &K);
-                getchar();
+                K = manifestFragments(); // after the splits of the handle, the manifest has the current K
+                if (K > 0) printf("Partitions in the manifest: %d\n", K);
+                else {
+                    printf("Enter K (number of partitions used): ");
+                    scanf("%d", &K);
+                    getchar();
+                }
                 
                 printf("Enter key to search: ");
                 scanf("%d", &key);
@@ -152,9 +224,13 @@ int main()
 
             case 10: // Insert into the partitioned file
                 printf("\n--- INSERT INTO PARTITIONED FILE ---\n");
-                printf("Enter K (number of partitions): ");
-                scanf("%d", &K);
-                getchar();
+                K = manifestFragments(); // after the splits of the handle, the manifest has the current K
+                if (K > 0) printf("Partitions in the manifest: %d\n", K);
+                else {
+                    printf("Enter K (number of partitions): ");
+                    scanf("%d", &K);
+                    getchar();
+                }
                 
                 printf("Enter key to insert: ");
                 scanf("%d", &(rec.key));
@@ -165,9 +241,13 @@ int main()
 
             case 11: // Delete from the partitioned file
                 printf("\n--- DELETE FROM PARTITIONED FILE ---\n");
-                printf("Enter K (number of partitions): ");
-                scanf("%d", &K);
-                getchar();
+                K = manifestFragments(); // after the splits of the handle, the manifest has the current K
+                if (K > 0) printf("Partitions in the manifest: %d\n", K);
+                else {
+                    printf("Enter K (number of partitions): ");
+                    scanf("%d", &K);
+                    getchar();
+                }
                 
                 printf("Enter key to delete: ");
                 scanf("%d", &key);
@@ -176,7 +256,323 @@ int main()
                 deletePartitioned(key, K);
                 break;    
 
-            case 12: // Exit
+            case 12: // Switch I/O backend
+                printf("\n--- I/O BACKEND ---\n");
+                if (getBackend() == BACKEND_STDIO) {
+                    setBackend(BACKEND_MMAP);
+                    printf("Files are now memory-mapped (blocks accessed in place)\n");
+                } else {
+                    setBackend(BACKEND_STDIO);
+                    printf("Files are now read and written through stdio\n");
+                }
+                break;
+
+            case 13: // Build hash index
+                printf("\n--- BUILD HASH INDEX ---\n");
+                buildIndex(file_name);
+                break;
+
+            case 14: // Parallel search and count
+                printf("\n--- PARALLEL SEARCH ---\n");
+                int threads;
+                printf("Enter key to search: ");
+                scanf("%d", &key);
+                getchar();
+                printf("Number of threads: ");
+                scanf("%d", &threads);
+                getchar();
+
+                parallelSearchTnOF(key, file_name, threads, &found, &i, &j);
+                if (found)
+                    printf("Record with key %d found at block %d, position %d (%ld occurrences)\n", key, i, j,
+                           countTnOF(key, file_name, threads));
+                else
+                    printf("Record with key %d not found. Can be inserted at block %d, position %d\n", key, i, j);
+                break;
+
+            case 15: // I/O statistics
+                printf("\n--- I/O STATISTICS ---\n");
+                printIOStats("All files", getGlobalStats());
+                if (getFileStats(file_name) != NULL)
+                    printIOStats(file_name, getFileStats(file_name));
+
+                PoolStats pool = getPoolStats();
+                if (pool.frames > 0)
+                    printf("Buffer pool: %d frames, %ld hits, %ld misses, %ld evictions, %ld write-backs\n",
+                           pool.frames, pool.hits, pool.misses, pool.evictions, pool.writeBacks);
+                break;
+
+            case 16: // Bulk load
+                printf("\n--- BULK LOAD ---\n");
+                char keyFile[100];
+                int format;
+                printf("Key file to load into %s: ", file_name);
+                scanf("%99s", keyFile);
+                getchar();
+                printf("Format (0 = text, 1 = binary int32): ");
+                scanf("%d", &format);
+                getchar();
+                printf("Enter loading factor (0.0 to 1.0): ");
+                scanf("%f", &loadingFactor);
+                getchar();
+
+                bulkLoadTnOF(file_name, keyFile, format, loadingFactor);
+                break;
+
+            case 17: // Buffer pool
+                printf("\n--- BUFFER POOL ---\n");
+                int frames;
+                printf("Number of cached blocks (0 to disable): ");
+                scanf("%d", &frames);
+                getchar();
+
+                setBufferPool(frames);
+                printf("Buffer pool: %d frames\n", frames > 0 ? frames : 0);
+                break;
+
+            case 18: // Partitioned table handle
+                printf("\n--- PARTITIONED FILE (MANIFEST) ---\n");
+                PartitionedTnOF table;
+                if (!openPartitioned(&table)) break;
+                printf("%d fragments, blockCapacity=%d\n", table.K, table.blockCapacity);
+                if (table.lh.level > 0 || table.lh.split > 0 || table.lh.splitBlocks > 0)
+                    printf("Linear hashing: base %d, level %d, split pointer %d, split past %d blocks\n",
+                           table.lh.base, table.lh.level, table.lh.split, table.lh.splitBlocks);
+                char op;
+                do {
+                    printf("Operation (s key: search, i key: insert, d key: delete, l blocks: linear hashing, c: compact, q: back): ");
+                    scanf(" %c", &op);
+                    if (op == 'c') {
+                        printf("%ld tombstones reclaimed\n", compactPartitionedTnOF(&table));
+                        continue;
+                    }
+                    if (op != 's' && op != 'i' && op != 'd' && op != 'l') continue;
+                    scanf("%d", &key);
+                    getchar();
+
+                    if (op == 'l') {
+                        setLinearHashing(&table, key);
+                        if (key > 0) printf("A fragment growing past %d blocks now splits the next fragment\n", key);
+                        else printf("Fragments are no longer split\n");
+                    } else if (op == 's') {
+                        searchPartitionedTnOF(&table, key, &found, &i, &j);
+                        if (found)
+                            printf("Record with key %d found in partition %d at block %d, position %d\n",
+                                   key, partitionOf(&table, key), i, j);
+                        else
+                            printf("Record with key %d not found\n", key);
+                    } else if (op == 'i') {
+                        rec.key = key;
+                        if (insertPartitionedTnOF(&table, rec)) printf("Your record has been added successfully\n");
+                        else printf("Key %d has no partition\n", key);
+                    } else {
+                        if (deletePartitionedTnOF(&table, key)) printf("Your record has been deleted successfully\n");
+                        else printf("Your record doesn't exist in the file\n");
+                    }
+                } while (op != 'q');
+                closePartitioned(&table);
+                break;
+
+            case 19: // Direct I/O
+                printf("\n--- DIRECT I/O ---\n");
+                setDirectIO(!getDirectIO());
+                if (getDirectIO())
+                    printf("Partition passes now read their source with O_DIRECT (page cache bypassed)\n");
+                else
+                    printf("Partition passes now read their source through the page cache\n");
+                break;
+
+            case 20: // Bloom filters
+                printf("\n--- BLOOM FILTERS ---\n");
+                int target;
+                printf("1. Build the filter of %s\n2. Set the filters built by partitioning and bulk loads\n", file_name);
+                printf("Choice: ");
+                scanf("%d", &target);
+                getchar();
+                printf("Filters (0: none, 1: one per file, 2: per file and per block): ");
+                scanf("%d", &mode);
+                getchar();
+
+                if (target == 1) {
+                    if (mode == BLOOM_OFF) dropBloom(file_name);
+                    else buildBloom(file_name, mode);
+                } else {
+                    setBloomFilters(mode);
+                    printf("Bloom filters for new fragments and loads: %s\n",
+                           mode == BLOOM_OFF ? "off" : mode == BLOOM_BLOCK ? "per file and per block" : "per file");
+                }
+                break;
+
+            case 21: // Asynchronous I/O
+                printf("\n--- ASYNCHRONOUS I/O ---\n");
+                int inFlight;
+                printf("Buffers of M kept in flight (read-ahead and queued writes, 0 to disable): ");
+                scanf("%d", &inFlight);
+                getchar();
+
+                setAsyncIO(inFlight);
+                printf("Asynchronous I/O: %d buffers in flight\n", getAsyncIO());
+                break;
+
+            case 22: // Sort
+                printf("\n--- SORT ---\n");
+                printf("1. Sort %s\n2. Sort the partitions\n", file_name);
+                printf("Choice: ");
+                scanf("%d", &target);
+                getchar();
+                printf("Enter the number of buffers (M): ");
+                scanf("%d", &M);
+                getchar();
+
+                if (target == 1) sortTnOF(file_name, M);
+                else {
+                    printf("Enter the number of partitions (K): ");
+                    scanf("%d", &K);
+                    getchar();
+                    sortPartitions(K, M);
+                }
+                break;
+
+            case 23: // Streaming partition
+                printf("\n--- STREAMING PARTITION ---\n");
+                char streamSource[100];
+                int flushMillis, idleMillis;
+                printf("Source (key file, named pipe or TnOF file): ");
+                scanf("%99s", streamSource);
+                getchar();
+                printf("Format (0 = text, 1 = binary int32, 2 = TnOF file followed as it grows): ");
+                scanf("%d", &format);
+                getchar();
+                printf("Enter K (number of fragments): ");
+                scanf("%d", &K);
+                getchar();
+                printf("Enter M (number of buffers): ");
+                scanf("%d", &M);
+                getchar();
+                loadingFactor = 0.8;
+                if (format != STREAM_TNOF) {
+                    printf("Enter loading factor (0.0 to 1.0): ");
+                    scanf("%f", &loadingFactor);
+                    getchar();
+                }
+                printf("Flush and checkpoint every (ms, 0 = only when full): ");
+                scanf("%d", &flushMillis);
+                getchar();
+                printf("Stop after the source is idle for (ms, 0 = at its end): ");
+                scanf("%d", &idleMillis);
+                getchar();
+
+                streamPartition(streamSource, format, K, M, loadingFactor, flushMillis, idleMillis);
+                break;
+
+            case 24: // Fragment skew
+                printf("\n--- FRAGMENT SKEW ---\n");
+                printf("1. Skew report of %s (sampled)\n2. Set the fragment size limit\n3. Split the partitions over the limit\n", file_name);
+                printf("Choice: ");
+                scanf("%d", &target);
+                getchar();
+
+                if (target == 2) {
+                    int limit;
+                    printf("Largest fragment in blocks (0 = never split): ");
+                    scanf("%d", &limit);
+                    getchar();
+                    setFragmentLimit(limit);
+                    if (getFragmentLimit() > 0)
+                        printf("Fragments over %d blocks are split into sub-fragments after partitioning\n", getFragmentLimit());
+                    else
+                        printf("Fragments are not split\n");
+                    break;
+                }
+                printf("Enter K (number of partitions): ");
+                scanf("%d", &K);
+                getchar();
+                if (target == 1) skewReport(file_name, K);
+                else {
+                    printf("Enter M (number of buffers): ");
+                    scanf("%d", &M);
+                    getchar();
+                    balancePartitions(K, M);
+                }
+                break;
+
+            case 25: // Tombstone deletes
+                printf("\n--- TOMBSTONE DELETES ---\n");
+                printf("1. Delete a record of %s (tombstone)\n2. Compact %s\n3. Toggle tombstones for partitioned deletes\n", file_name, file_name);
+                printf("4. Start the background compactor\n5. Stop the background compactor\n");
+                printf("Choice: ");
+                scanf("%d", &target);
+                getchar();
+
+                if (target == 1) {
+                    printf("Enter the key of the record to delete: ");
+                    scanf("%d", &key);
+                    getchar();
+                    deleteTnOFlog(file_name, key);
+                } else if (target == 2) {
+                    compactTnOF(file_name);
+                } else if (target == 3) {
+                    setTombstoneDeletes(!getTombstoneDeletes());
+                    if (getTombstoneDeletes())
+                        printf("Partitioned deletes now leave tombstones (reclaimed by compaction)\n");
+                    else
+                        printf("Partitioned deletes now move the last record into the freed slot\n");
+                } else if (target == 4) {
+                    int threshold, interval;
+                    printf("Compact a closed file once tombstones reach (%% of its records): ");
+                    scanf("%d", &threshold);
+                    getchar();
+                    printf("Check every (ms): ");
+                    scanf("%d", &interval);
+                    getchar();
+                    if (startCompactor(threshold, interval)) printf("Background compactor started\n");
+                    else printf("The background compactor is already running\n");
+                } else {
+                    stopCompactor();
+                    printf("Background compactor stopped\n");
+                }
+                break;
+
+            case 26: // Block encoding
+                printf("\n--- BLOCK ENCODING ---\n");
+                printf("1. Pack %s (read-only, bit-packed blocks)\n2. Unpack %s\n3. Toggle the encoding of new files\n", file_name, file_name);
+                printf("Choice: ");
+                scanf("%d", &target);
+                getchar();
+
+                if (target == 1) packTnOF(file_name);
+                else if (target == 2) unpackTnOF(file_name);
+                else {
+                    setBlockEncoding(getBlockEncoding() == ENCODING_PACKED ? ENCODING_RAW : ENCODING_PACKED);
+                    if (getBlockEncoding() == ENCODING_PACKED)
+                        printf("Initial and bulk loads now create packed files\n");
+                    else
+                        printf("Initial and bulk loads now create raw files\n");
+                }
+                break;
+
+            case 27: // Grace hash join
+                printf("\n--- JOIN ON KEY ---\n");
+                char other[50], output[50];
+                printf("Enter the file to join %s with: ", file_name);
+                scanf("%49s", other);
+                getchar();
+                printf("Enter K (number of fragments of each file): ");
+                scanf("%d", &K);
+                getchar();
+                printf("Enter M (number of buffers, must be >= 3): ");
+                scanf("%d", &M);
+                getchar();
+                printf("Enter the output file (- to only count the matches): ");
+                scanf("%49s", output);
+                getchar();
+
+                long matches = joinTnOF(file_name, other, K, M, strcmp(output, "-") == 0 ? NULL : output, NULL, NULL);
+                if (matches >= 0) printf("%ld matching pairs\n", matches);
+                break;
+
+            case 0: // Exit
+                stopCompactor();
                 printf("Exiting program.\n");
                 break;
 
@@ -184,7 +580,7 @@ int main()
                 printf("Invalid choice! Please try again.\n");
         }
 
-    } while(choice != 12);
+    } while(choice != 0);
 
     return 0;
 }
\ No newline at end of file
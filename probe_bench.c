@@ -0,0 +1,54 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "TnOF_BIB.h"
+
+// Microbenchmark of the block probe kernels: probes random keys in full in-memory blocks
+// (half of them present) with every kernel the CPU supports, and compares to the scalar loop.
+
+#define NB_BLOCKS 4096
+#define ROUNDS 200
+
+static double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main()
+{
+    Tblock *blocks = malloc(NB_BLOCKS * sizeof(Tblock));
+    int *keys = malloc(NB_BLOCKS * sizeof(int));
+    srand(42);
+    for (int b = 0; b < NB_BLOCKS; b++) {
+        blocks[b].nb_rec = MAX_RECORDS;
+        for (int j = 0; j < MAX_RECORDS; j++) blocks[b].T[j].key = rand();
+        keys[b] = (b % 2) ? blocks[b].T[rand() % MAX_RECORDS].key : -1 - rand() % 1000;
+    }
+
+    const int kernels[] = {PROBE_SCALAR, PROBE_SSE2, PROBE_AVX2};
+    double scalarTime = 0;
+    for (int k = 0; k < 3; k++) {
+        if (!setProbeKernel(kernels[k])) {
+            printf("%-7s not supported by this CPU\n", k == 1 ? "sse2" : "avx2");
+            continue;
+        }
+        long checksum = 0;
+        double start = now();
+        for (int r = 0; r < ROUNDS; r++) {
+            for (int b = 0; b < NB_BLOCKS; b++) {
+                checksum += probeBlock(&blocks[b], keys[b]);
+                checksum += countInBlock(&blocks[b], keys[b]);
+            }
+        }
+        double elapsed = now() - start;
+        if (kernels[k] == PROBE_SCALAR) scalarTime = elapsed;
+        printf("%-7s %6.1f ns per block (probe + count), speedup x%.2f, checksum %ld\n", probeKernelName(),
+               elapsed * 1e9 / (ROUNDS * NB_BLOCKS), scalarTime / elapsed, checksum);
+    }
+
+    free(blocks);
+    free(keys);
+    return 0;
+}